@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <GLES3/gl31.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "framesconv.h"
+#include "gpu.h"
+#include "stats.h"
+#include "utils.h"
+
+namespace {
+
+const auto kVertexShaderSource = R"(
+attribute vec2 position;
+
+void main() {
+  gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);
+}
+//)";
+
+// mburakov: Synthetic pattern varying both horizontally and vertically, so that
+// neither luma nor chroma planes are uniform.
+const auto kFragmentShaderSource = R"(
+precision mediump float;
+
+uniform float seed;
+
+void main() {
+  vec2 position = gl_FragCoord.xy;
+  gl_FragColor = vec4(fract(position.x / 251.0 + seed),
+                      fract(position.y / 241.0 + seed),
+                      fract((position.x + position.y) / 239.0), 1.0);
+}
+//)";
+
+const std::pair<std::size_t, std::size_t> kResolutions[] = {
+    {1280, 720}, {1920, 1080}, {2560, 1440}, {3840, 2160}, {7680, 4320}};
+
+// mburakov: Subset of tuning candidates, covering wavefronts of 32 and 64.
+const std::pair<std::size_t, std::size_t> kWorkgroups[] = {
+    {2, 2}, {4, 4}, {8, 4}, {8, 8}, {16, 4}, {16, 8}, {32, 2}};
+
+const std::pair<ComputeKernel, const char*> kKernels[] = {
+    {ComputeKernel::kDirect, "direct"}, {ComputeKernel::kShared, "shared"}};
+
+// mburakov: Small frames are additionally converted in batches, tiled in
+// atlases of kBatchColumns by kBatchColumns frames.
+const std::pair<std::size_t, std::size_t> kBatchResolutions[] = {
+    {320, 240}, {640, 360}};
+constexpr std::size_t kBatchColumns = 8;
+
+// mburakov: Frames are alternated between several buffers, so that caches are
+// not kept warm by converting the same frame over and over again.
+constexpr std::size_t kBuffers = 3;
+
+struct Options {
+  const char* render_node;
+  std::size_t warmup;
+  std::size_t iterations;
+  bool tiled;
+};
+
+Options ParseCommandline(int argc, const char* const argv[]) {
+  using namespace std::literals::string_view_literals;
+  static const auto& check_count = [](const char* in) {
+    if (!in) throw std::invalid_argument("Missing argument");
+    auto value = std::atoi(in);
+    if (value <= 0) throw std::invalid_argument("Count must be positive");
+    return static_cast<std::size_t>(value);
+  };
+  Options result{};
+  result.render_node = "/dev/dri/renderD128";
+  result.warmup = 16;
+  result.iterations = 256;
+  for (auto it = argv; it < argv + argc; it++) {
+    if (*it == "-r"sv)
+      result.render_node = *++it;
+    else if (*it == "-warmup"sv)
+      result.warmup = check_count(*++it);
+    else if (*it == "-n"sv)
+      result.iterations = check_count(*++it);
+    else if (*it == "-tiled"sv)
+      result.tiled = true;
+  }
+  return result;
+}
+
+// mburakov: Renders synthetic frames directly into gbm buffers, so that
+// neither disk nor cpu uploads are part of the measurement.
+class PatternGenerator {
+ public:
+  PatternGenerator();
+  ~PatternGenerator();
+
+  PatternGenerator(const PatternGenerator&) = delete;
+  PatternGenerator(PatternGenerator&&) = delete;
+  PatternGenerator& operator=(const PatternGenerator&) = delete;
+  PatternGenerator& operator=(PatternGenerator&&) = delete;
+
+  void Generate(GLuint texture, std::size_t width, std::size_t height,
+                float seed) const;
+
+ private:
+  GLuint framebuffer_;
+  GLuint program_;
+  GLint seed_;
+};
+
+PatternGenerator::PatternGenerator() {
+  GLuint framebuffer{};
+  glGenFramebuffers(1, &framebuffer);
+  if (!framebuffer) {
+    throw std::runtime_error(
+        WrapGlError("Failed to allocate framebuffer name"));
+  }
+  Defer deferred_gl_delete_framebuffers([&framebuffer] {
+    if (framebuffer) glDeleteFramebuffers(1, &framebuffer);
+  });
+
+  GLuint program = CreateGlProgram(kVertexShaderSource, kFragmentShaderSource);
+  Defer deferred_gl_delete_program([&program] {
+    if (program) glDeleteProgram(program);
+  });
+  seed_ = glGetUniformLocation(program, "seed");
+  if (seed_ == -1)
+    throw std::runtime_error(WrapGlError("Failed to get seed location"));
+
+  framebuffer_ = std::exchange(framebuffer, 0);
+  program_ = std::exchange(program, 0);
+}
+
+PatternGenerator::~PatternGenerator() {
+  glDeleteProgram(program_);
+  glDeleteFramebuffers(1, &framebuffer_);
+}
+
+void PatternGenerator::Generate(GLuint texture, std::size_t width,
+                                std::size_t height, float seed) const {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         texture, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    throw std::runtime_error("Pattern framebuffer is incomplete");
+  }
+  glViewport(0, 0, static_cast<GLsizei>(width), static_cast<GLsizei>(height));
+  glUseProgram(program_);
+  glUniform1f(seed_, seed);
+  static const GLfloat kVertices[] = {0, 0, 1, 0, 1, 1, 0, 1};
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, kVertices);
+  glEnableVertexAttribArray(0);
+  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  glDisableVertexAttribArray(0);
+  glUseProgram(0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (GLenum error = glGetError(); error != GL_NO_ERROR)
+    throw std::runtime_error(WrapGlError("Pattern generation failed", error));
+}
+
+// mburakov: Set of source and destination buffers of a single resolution.
+// Every buffer holds columns by columns tiled frames if columns is not one.
+// Sources are allocated with provided modifiers, while destinations are always
+// linear, because their layouts are only meaningful in linear memory.
+struct Frames {
+  Frames(const GbmDevice& device, const EglContext& context,
+         const PatternGenerator& generator,
+         const std::vector<std::uint64_t>& modifiers, std::size_t width,
+         std::size_t height, std::size_t columns = 1)
+      : width{width}, height{height}, columns{columns} {
+    for (std::size_t i = 0; i < kBuffers; i++) {
+      buffers_rgbx.emplace_back(
+          device.CreateGbmBuffer(width * columns, height * columns,
+                                 DRM_FORMAT_ABGR8888, modifiers));
+      buffers_nv12.emplace_back(
+          device.CreateGbmBuffer(GetNv12Width(width) * columns,
+                                 GetNv12Height(height) * columns));
+    }
+    for (std::size_t i = 0; i < kBuffers; i++) {
+      textures_rgbx.emplace_back(std::make_unique<GlTexture>(
+          buffers_rgbx[i], context.GetDisplay()));
+      textures_nv12.emplace_back(std::make_unique<GlTexture>(
+          buffers_nv12[i], context.GetDisplay()));
+      generator.Generate(textures_rgbx[i]->Get(), width * columns,
+                         height * columns, static_cast<float>(i) / kBuffers);
+    }
+    context.Sync();
+  }
+
+  std::size_t width;
+  std::size_t height;
+  std::size_t columns;
+  std::vector<GbmBuffer> buffers_rgbx;
+  std::vector<GbmBuffer> buffers_nv12;
+  std::vector<std::unique_ptr<GlTexture>> textures_rgbx;
+  std::vector<std::unique_ptr<GlTexture>> textures_nv12;
+};
+
+// mburakov: Throughput is measured with conversions submitted back to back,
+// while latency is measured by waiting for every single conversion. Batches
+// count as multiple frames for throughput, but as a single one for latency.
+void RunCase(const EglContext& context, const Options& options,
+             const Framesconv& framesconv, const Frames& frames,
+             const char* backend, const char* kernel,
+             const std::string& workgroup) {
+  const std::size_t batch = frames.columns * frames.columns;
+  auto convert = [&](std::size_t i) {
+    GLuint atlas_rgbx = frames.textures_rgbx[i % kBuffers]->Get();
+    GLuint atlas_nv12 = frames.textures_nv12[i % kBuffers]->Get();
+    if (batch == 1) {
+      framesconv.Convert(atlas_rgbx, frames.width, frames.height, &atlas_nv12);
+    } else {
+      framesconv.ConvertBatch(atlas_rgbx, frames.width, frames.height,
+                              frames.columns, batch, &atlas_nv12);
+    }
+  };
+  for (std::size_t i = 0; i < options.warmup; i++) convert(i);
+  context.Sync();
+
+  using namespace std::chrono;
+  auto before = steady_clock::now();
+  for (std::size_t i = 0; i < options.iterations; i++) convert(i);
+  context.Sync();
+  auto seconds = duration<double>(steady_clock::now() - before).count();
+
+  Histogram latency;
+  for (std::size_t i = 0; i < options.iterations; i++) {
+    auto before = steady_clock::now();
+    convert(i);
+    context.WaitFence(context.CreateFence());
+    latency.Record(static_cast<std::uint64_t>(
+        duration_cast<microseconds>(steady_clock::now() - before).count()));
+  }
+
+  // mburakov: Effective bandwidth counts reading the source and writing the
+  // destination once, regardless of what the gpu does under the hood.
+  double fps = static_cast<double>(options.iterations * batch) / seconds;
+  double bytes = static_cast<double>(frames.width * frames.height * 4 +
+                                     frames.width * frames.height * 3 / 2);
+  char message[512];
+  std::snprintf(message, sizeof(message),
+                "{\"backend\":\"%s\",\"width\":%zu,\"height\":%zu,"
+                "\"kernel\":\"%s\",\"workgroup\":\"%s\",\"batch\":%zu,"
+                "\"modifier\":\"0x%016llx\",\"frames\":%zu,\"fps\":%.1f,"
+                "\"gbps\":%.2f,\"latency_us\":{\"mean\":%llu,\"p50\":%llu,"
+                "\"p99\":%llu,\"max\":%llu}}",
+                backend, frames.width, frames.height, kernel,
+                workgroup.c_str(), batch,
+                static_cast<unsigned long long>(
+                    frames.buffers_rgbx.front().GetModifier()),
+                options.iterations * batch, fps,
+                fps * bytes / 1e9,
+                static_cast<unsigned long long>(latency.GetMean()),
+                static_cast<unsigned long long>(latency.GetPercentile(50)),
+                static_cast<unsigned long long>(latency.GetPercentile(99)),
+                static_cast<unsigned long long>(latency.GetMax()));
+  std::cout << message << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) try {
+  const auto& options = ParseCommandline(argc, argv);
+  GbmDevice device(options.render_node);
+
+  // mburakov: Every backend gets the context version it is meant for. Egl
+  // display is shared, so contexts must not overlap.
+  for (bool es20 : {false, true}) {
+    const auto& context_version =
+        es20 ? std::make_pair(2, 0) : std::make_pair(3, 1);
+    EglContext context(context_version.first, context_version.second);
+    context.MakeCurrent();
+    Defer deferred_reset_current([&context] { context.ResetCurrent(); });
+
+    GLint max_invocations{};
+    if (!es20)
+      glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+    PatternGenerator generator;
+    const auto& modifiers = options.tiled
+                                ? context.QueryModifiers(DRM_FORMAT_ABGR8888)
+                                : std::vector<std::uint64_t>{};
+    GLint max_shared_memory{};
+    if (!es20)
+      glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &max_shared_memory);
+    auto run_es31 = [&](const Frames& frames) {
+      for (const auto& kernel : kKernels) {
+        for (const auto& it : kWorkgroups) {
+          if (it.first * it.second > static_cast<std::size_t>(max_invocations))
+            continue;
+          FramesconvParams params;
+          params.kernel = kernel.first;
+          params.workgroup_width = it.first;
+          params.workgroup_height = it.second;
+          if (GetSharedMemorySize(params) >
+              static_cast<std::size_t>(max_shared_memory)) {
+            continue;
+          }
+          const auto& framesconv = CreateFramesconvES31(params);
+          RunCase(context, options, *framesconv, frames, "es31", kernel.second,
+                  std::to_string(it.first) + "x" + std::to_string(it.second));
+        }
+      }
+    };
+    for (const auto& resolution : kResolutions) {
+      Frames frames(device, context, generator, modifiers, resolution.first,
+                    resolution.second);
+      if (es20) {
+        const auto& framesconv = CreateFramesconvES20({});
+        RunCase(context, options, *framesconv, frames, "es20", "-", "-");
+        continue;
+      }
+      run_es31(frames);
+    }
+    if (es20) continue;
+    for (const auto& resolution : kBatchResolutions) {
+      for (std::size_t columns : {std::size_t{1}, kBatchColumns}) {
+        Frames frames(device, context, generator, modifiers,
+                      resolution.first, resolution.second, columns);
+        run_es31(frames);
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+} catch (const std::exception& ex) {
+  std::cerr << ex.what() << std::endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "container.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include "gpu.h"
+#include "utils.h"
+
+namespace {
+
+std::size_t GetFileSize(int fd) {
+  struct stat fd_stat{};
+  if (fstat(fd, &fd_stat)) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to stat file");
+  }
+  return static_cast<std::size_t>(fd_stat.st_size);
+}
+
+// mburakov: Copies rows of row_size bytes, at once if both sides are packed.
+void CopyRows(char* target, std::size_t target_stride, const char* source,
+              std::size_t source_stride, std::size_t rows,
+              std::size_t row_size) {
+  if (target_stride == row_size && source_stride == row_size) {
+    std::memcpy(target, source, rows * row_size);
+    return;
+  }
+  for (std::size_t row = 0; row < rows; row++) {
+    std::memcpy(target + row * target_stride, source + row * source_stride,
+                row_size);
+  }
+}
+
+std::size_t GetFrameSize(const MappedInput& input) {
+  if (input.height &&
+      input.stride > std::numeric_limits<std::size_t>::max() / input.height) {
+    throw std::runtime_error("Mapped input frames are too large");
+  }
+  return input.stride * input.height;
+}
+
+class MappedSource final : public FrameSource {
+ public:
+  MappedSource(const char* path, const MappedInput& input, std::size_t depth);
+
+  // FrameSource
+  const GbmBuffer* Acquire(
+      const GbmBuffer& buffer,
+      std::unique_ptr<std::nullptr_t, FdCloser>* fence) override;
+  void Release(const GbmBuffer*, int) override {}
+
+ private:
+  const MappedInput input_;
+  const std::size_t depth_;
+  const std::size_t frame_size_;
+  std::size_t next_frame_{};
+  std::unique_ptr<void, Unmapper> data_{nullptr, Unmapper{}};
+};
+
+MappedSource::MappedSource(const char* path, const MappedInput& input,
+                           std::size_t depth)
+    : input_{input},
+      depth_{depth},
+      frame_size_{GetFrameSize(input)} {
+  if (!input.frames) return;
+  // mburakov: Mapping outlives the fd.
+  const auto& fd = OpenFile(path, O_RDONLY);
+  const std::size_t size = GetFileSize(fd.get());
+  if (input.offset > size || !frame_size_ ||
+      input.frames > (size - input.offset) / frame_size_) {
+    throw std::runtime_error("Mapped input is truncated");
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+  if (data == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to mmap input");
+  }
+  data_ = {data, Unmapper{size}};
+  madvise(data, size, MADV_SEQUENTIAL);
+}
+
+const GbmBuffer* MappedSource::Acquire(
+    const GbmBuffer& buffer, std::unique_ptr<std::nullptr_t, FdCloser>*) {
+  if (next_frame_ == input_.frames) return nullptr;
+  if (buffer.GetWidth() != input_.width ||
+      buffer.GetHeight() != input_.height ||
+      buffer.GetFourcc() != input_.fourcc) {
+    throw std::logic_error("Mapped input does not match source buffers");
+  }
+  auto base = static_cast<const char*>(data_.get());
+  const char* frame = base + input_.offset + next_frame_++ * frame_size_;
+
+  // mburakov: Kernel reads following frames in the background, while this one
+  // is converted. Advice must start on a page boundary.
+  const auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  const std::size_t ahead = static_cast<std::size_t>(frame - base) +
+                            frame_size_;
+  const std::size_t ahead_page = ahead / page_size * page_size;
+  const std::size_t end =
+      std::min(ahead + frame_size_ * depth_, data_.get_deleter().size);
+  if (end > ahead_page) {
+    madvise(const_cast<char*>(base) + ahead_page, end - ahead_page,
+            MADV_WILLNEED);
+  }
+
+  buffer.BeginAccess(GbmBuffer::Access::kWrite);
+  Defer deferred_end_access(
+      [&buffer] { buffer.EndAccess(GbmBuffer::Access::kWrite); });
+  CopyRows(static_cast<char*>(buffer.GetData()), buffer.GetStride(), frame,
+           input_.stride, input_.height,
+           input_.width * GetBytesPerPixel(input_.fourcc));
+  return &buffer;
+}
+
+class MappedSink final : public FrameSink {
+ public:
+  MappedSink(const char* path, std::size_t width, std::size_t height,
+             const LayoutDescriptor& descriptor, std::size_t frames,
+             bool container);
+  ~MappedSink() override;
+
+  MappedSink(const MappedSink&) = delete;
+  MappedSink(MappedSink&&) = delete;
+  MappedSink& operator=(const MappedSink&) = delete;
+  MappedSink& operator=(MappedSink&&) = delete;
+
+  // FrameSink
+  bool AcceptsFence() const override { return false; }
+  void Write(const GbmBuffer& buffer, int,
+             std::function<void()> release) override;
+  void Flush() override {}
+
+ private:
+  void Reserve(std::size_t frames);
+  void WriteHeader(std::size_t frames) const;
+
+  const std::size_t width_;
+  const std::size_t height_;
+  const LayoutDescriptor descriptor_;
+  const std::size_t header_size_;
+  std::size_t frame_size_{};
+  std::size_t capacity_{};
+  std::size_t written_{};
+  std::unique_ptr<std::nullptr_t, FdCloser> fd_;
+  std::unique_ptr<void, Unmapper> data_{nullptr, Unmapper{}};
+};
+
+MappedSink::MappedSink(const char* path, std::size_t width,
+                       std::size_t height, const LayoutDescriptor& descriptor,
+                       std::size_t frames, bool container)
+    : width_{width},
+      height_{height},
+      descriptor_{descriptor},
+      header_size_{container ? sizeof(ContainerHeader) : 0},
+      fd_{OpenFile(path, O_RDWR | O_CREAT | O_TRUNC)} {
+  for (std::size_t i = 0; i < descriptor.planes; i++)
+    frame_size_ += descriptor.plane[i].rows * descriptor.plane[i].bytes;
+  Reserve(std::max(frames, std::size_t{1}));
+  WriteHeader(frames);
+}
+
+MappedSink::~MappedSink() {
+  // mburakov: Header of the container is only final once the amount of frames
+  // is known, and the file is trimmed to that amount.
+  WriteHeader(written_);
+  data_.reset();
+  if (ftruncate(fd_.get(),
+                static_cast<off_t>(header_size_ + written_ * frame_size_))) {
+    // mburakov: Nothing could be done about it here.
+  }
+}
+
+void MappedSink::Write(const GbmBuffer& buffer, int,
+                       std::function<void()> release) {
+  if (written_ == capacity_) Reserve(capacity_ * 2);
+  const std::size_t offset = header_size_ + written_ * frame_size_;
+  char* target = static_cast<char*>(data_.get()) + offset;
+  {
+    // mburakov: Rows of every plane are trimmed to their packed size.
+    auto source = static_cast<const char*>(buffer.GetData());
+    buffer.BeginAccess(GbmBuffer::Access::kRead);
+    Defer deferred_end_access(
+        [&buffer] { buffer.EndAccess(GbmBuffer::Access::kRead); });
+    for (std::size_t i = 0; i < descriptor_.planes; i++) {
+      const auto& plane = descriptor_.plane[i];
+      CopyRows(target, plane.bytes, source + plane.row * buffer.GetStride(),
+               buffer.GetStride(), plane.rows, plane.bytes);
+      target += plane.rows * plane.bytes;
+    }
+  }
+  written_++;
+  release();
+  // mburakov: Writeback is started right away, so that dirty pages of bulk
+  // jobs do not pile up until the kernel decides to flush them all at once.
+  sync_file_range(fd_.get(), static_cast<off_t>(offset),
+                  static_cast<off_t>(frame_size_), SYNC_FILE_RANGE_WRITE);
+}
+
+void MappedSink::Reserve(std::size_t frames) {
+  const std::size_t size = header_size_ + frames * frame_size_;
+  // mburakov: Not all the filesystems support preallocation.
+  if (fallocate(fd_.get(), 0, 0, static_cast<off_t>(size))) {
+    if (errno != EOPNOTSUPP || ftruncate(fd_.get(), static_cast<off_t>(size))) {
+      throw std::system_error(errno, std::system_category(),
+                              "Failed to allocate output");
+    }
+  }
+  void* data = data_ ? mremap(data_.get(), data_.get_deleter().size, size,
+                              MREMAP_MAYMOVE)
+                     : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd_.get(), 0);
+  if (data == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to mmap output");
+  }
+  // mburakov: Old mapping is already gone if it was remapped.
+  data_.release();
+  data_ = {data, Unmapper{size}};
+  capacity_ = frames;
+}
+
+void MappedSink::WriteHeader(std::size_t frames) const {
+  if (!header_size_) return;
+  const ContainerHeader header = {kContainerMagic,
+                                  kContainerVersion,
+                                  static_cast<std::uint32_t>(frames),
+                                  static_cast<std::uint32_t>(width_),
+                                  static_cast<std::uint32_t>(height_),
+                                  descriptor_.fourcc,
+                                  static_cast<std::uint32_t>(
+                                      descriptor_.plane[0].bytes),
+                                  sizeof(ContainerHeader)};
+  std::memcpy(data_.get(), &header, sizeof(header));
+}
+
+}  // namespace
+
+MappedInput DescribeMappedInput(const char* path, std::size_t width,
+                                std::size_t height, std::uint32_t fourcc) {
+  const auto& fd = OpenFile(path, O_RDONLY);
+  const std::size_t size = GetFileSize(fd.get());
+  ContainerHeader header{};
+  ssize_t result = pread(fd.get(), &header, sizeof(header), 0);
+  if (result < 0) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to read input");
+  }
+  if (static_cast<std::size_t>(result) != sizeof(header) ||
+      header.magic != kContainerMagic) {
+    // mburakov: Raw files are tightly packed frames back to back.
+    if (!width || !height)
+      throw std::invalid_argument("Raw mapped input requires dimensions");
+    if (width > kMaxFrameDimension || height > kMaxFrameDimension)
+      throw std::invalid_argument("Raw mapped input dimensions are too large");
+    const std::size_t stride = width * GetBytesPerPixel(fourcc);
+    return {false, size / (stride * height), width, height, fourcc, stride, 0};
+  }
+  if (header.version != kContainerVersion)
+    throw std::runtime_error("Unsupported container version");
+  if (!header.width || !header.height ||
+      header.width > kMaxFrameDimension ||
+      header.height > kMaxFrameDimension ||
+      header.stride < header.width * GetBytesPerPixel(header.fourcc) ||
+      header.offset < sizeof(header)) {
+    throw std::runtime_error("Malformed container header");
+  }
+  if ((width && width != header.width) || (height && height != header.height))
+    throw std::invalid_argument("Container dimensions mismatch");
+  return {true,         header.frames, header.width, header.height,
+          header.fourcc, header.stride, header.offset};
+}
+
+std::unique_ptr<FrameSource> CreateMappedSource(const char* path,
+                                                const MappedInput& input,
+                                                std::size_t depth) {
+  return std::make_unique<MappedSource>(path, input, depth);
+}
+
+std::unique_ptr<FrameSink> CreateMappedSink(const char* path,
+                                            std::size_t width,
+                                            std::size_t height,
+                                            OutputLayout layout,
+                                            OutputFormat output,
+                                            std::size_t frames,
+                                            bool container) {
+  return std::make_unique<MappedSink>(
+      path, width, height, GetLayoutDescriptor(width, height, layout, output),
+      frames, container);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_CONTAINER_H_
+#define FRAMESCONV_CONTAINER_H_
+
+#include <libdrm/drm_fourcc.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "pipeline.h"
+
+// mburakov: Header of a container of raw frames. It is followed by frames
+// frames starting at offset bytes from the beginning of the file. Source
+// frames are height rows of stride bytes, while converted frames are tightly
+// packed planes of the fourcc, with stride bytes per row of the first plane.
+// Fields are in host byte order.
+constexpr std::uint32_t kContainerMagic = fourcc_code('F', 'C', 'N', 'V');
+constexpr std::uint32_t kContainerVersion = 1;
+
+struct ContainerHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t frames;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t fourcc;
+  std::uint32_t stride;
+  std::uint32_t offset;
+};
+
+// mburakov: Describes frames of a mapped input file, either according to its
+// container header, or, for raw files without one, according to provided
+// dimensions and fourcc, in which case frames are tightly packed and their
+// amount is derived from the size of the file. Provided dimensions, if any,
+// must match the ones of the container.
+struct MappedInput {
+  bool container;
+  std::size_t frames;
+  std::size_t width;
+  std::size_t height;
+  std::uint32_t fourcc;
+  std::size_t stride;
+  std::size_t offset;
+};
+
+MappedInput DescribeMappedInput(const char* path, std::size_t width,
+                                std::size_t height, std::uint32_t fourcc);
+
+// mburakov: Maps the whole input file once, and copies frames from the mapping
+// straight into source buffers, advising the kernel to read depth frames
+// ahead.
+std::unique_ptr<FrameSource> CreateMappedSource(const char* path,
+                                                const MappedInput& input,
+                                                std::size_t depth);
+
+// mburakov: Creates output file preallocated for expected amount of frames,
+// or growing on demand if it is zero, and copies converted frames straight into
+// its mapping. The file is trimmed to the amount of written frames once the
+// sink is destroyed. Container header is only written if requested.
+std::unique_ptr<FrameSink> CreateMappedSink(const char* path,
+                                            std::size_t width,
+                                            std::size_t height,
+                                            OutputLayout layout,
+                                            OutputFormat output,
+                                            std::size_t frames,
+                                            bool container);
+
+#endif  // FRAMESCONV_CONTAINER_H_
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "daemon.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <iostream>
+#include <istream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+#include "pool.h"
+#include "protocol.h"
+#include "socket.h"
+#include "utils.h"
+
+namespace {
+
+// mburakov: Exposes memory mapping of a memfd as a stream, so that gbm buffers
+// are filled from and drained to shared memory the same way as to files.
+// Streams are seekable, so that damaged areas are copied in place.
+class MemoryStreambuf final : public std::streambuf {
+ public:
+  MemoryStreambuf(int fd, std::size_t size, bool writable);
+
+ protected:
+  // std::streambuf
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override;
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+ private:
+  std::unique_ptr<void, Unmapper> data_{nullptr, Unmapper{}};
+};
+
+MemoryStreambuf::MemoryStreambuf(int fd, std::size_t size, bool writable) {
+  struct stat fd_stat{};
+  if (fstat(fd, &fd_stat)) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to stat shared memory");
+  }
+  if (static_cast<std::size_t>(fd_stat.st_size) < size)
+    throw std::runtime_error("Shared memory is too small");
+  const int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void* data = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to mmap shared memory");
+  }
+  data_ = {data, Unmapper{size}};
+  auto begin = static_cast<char*>(data);
+  setg(begin, begin, begin + size);
+  setp(begin, begin + size);
+}
+
+std::streambuf::pos_type MemoryStreambuf::seekoff(
+    off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+  off_type base{};
+  if (dir == std::ios_base::cur) {
+    // mburakov: Relative seek is ambiguous if both positions are requested.
+    if ((which & std::ios_base::in) && (which & std::ios_base::out))
+      return pos_type(off_type(-1));
+    base = which & std::ios_base::in ? gptr() - eback()
+                                     : pptr() - static_cast<char*>(data_.get());
+  } else if (dir == std::ios_base::end) {
+    base = egptr() - eback();
+  }
+  return seekpos(pos_type(base + off), which);
+}
+
+std::streambuf::pos_type MemoryStreambuf::seekpos(
+    pos_type pos, std::ios_base::openmode which) {
+  const off_type offset = pos;
+  if (offset < 0 || offset > egptr() - eback()) return pos_type(off_type(-1));
+  if (which & std::ios_base::in) setg(eback(), eback() + offset, egptr());
+  // mburakov: Put area is restarted at the new position, because pbump only
+  // takes int, while get area keeps the beginning of the memory.
+  if (which & std::ios_base::out) setp(eback() + offset, egptr());
+  return pos;
+}
+
+// mburakov: Drains parts of planes of the layout covering the rect, that must
+// be aligned with Framesconv::AlignDamage, to the tightly packed planes. Start
+// of the aligned rect is a multiple of the scale, so that boundaries of every
+// plane are found by describing layouts of the frames ending at the corners.
+void DrainDamage(const GbmBuffer& buffer, std::ostream& stream,
+                 const LayoutDescriptor& descriptor, const DamageRect& rect,
+                 const FramesconvParams& params) {
+  const auto& target = params.targets.front();
+  const auto& begin = GetLayoutDescriptor(
+      rect.x / target.scale, rect.y / target.scale, target.layout,
+      params.output);
+  const auto& end = GetLayoutDescriptor(
+      GetScaledSize(rect.x + rect.width, target.scale),
+      GetScaledSize(rect.y + rect.height, target.scale), target.layout,
+      params.output);
+  std::size_t plane_offset{};
+  for (std::size_t i = 0; i < descriptor.planes; i++) {
+    const auto& plane = descriptor.plane[i];
+    const std::size_t first_row = begin.plane[i].rows;
+    const std::size_t first_byte = begin.plane[i].bytes;
+    stream.seekp(static_cast<std::streamoff>(
+        plane_offset + first_row * plane.bytes + first_byte));
+    buffer.DrainRectTo(stream, plane.row + first_row,
+                       end.plane[i].rows - first_row, first_byte,
+                       end.plane[i].bytes - first_byte, plane.bytes);
+    plane_offset += plane.rows * plane.bytes;
+  }
+}
+
+template <class T>
+T CheckEnum(std::uint32_t value, T last) {
+  if (value > static_cast<std::uint32_t>(last))
+    throw std::invalid_argument("Invalid enum value in request");
+  return static_cast<T>(value);
+}
+
+class Daemon {
+ public:
+  Daemon(const GbmDevice& device, const EglContext& context,
+         const FramesconvParams& params, std::size_t pool_capacity)
+      : context_{context},
+        params_{params},
+        pool_{device, context.GetDisplay(), pool_capacity} {}
+
+  // mburakov: Serves a single request of the client. Returns false if the
+  // client disconnected.
+  bool Serve(int client);
+
+ private:
+  using ProgramKey =
+      std::tuple<ColorMatrix, ColorRange, OutputFormat, OutputLayout,
+                 std::size_t, bool>;
+
+  const Framesconv& GetFramesconv(const FramesconvParams& params);
+
+  const EglContext& context_;
+  FramesconvParams params_;
+  std::map<ProgramKey, std::unique_ptr<Framesconv>> programs_;
+  // mburakov: Staging buffers are used when the client provides shared memory
+  // instead of a dma-buf.
+  BufferPool pool_;
+};
+
+const Framesconv& Daemon::GetFramesconv(const FramesconvParams& params) {
+  const auto& target = params.targets.front();
+  ProgramKey key{params.matrix, params.range, params.output, target.layout,
+                 target.scale, params.dither};
+  auto it = programs_.find(key);
+  if (it == programs_.end())
+    it = programs_.emplace(key, CreateFramesconvES31(params)).first;
+  return *it->second;
+}
+
+bool Daemon::Serve(int client) {
+  ConvertRequest request{};
+  std::unique_ptr<std::nullptr_t, FdCloser> fds[2];
+  if (!ReceiveMessage(client, &request, sizeof(request), fds, 2)) return false;
+  if (!request.width || !request.height ||
+      request.width > kMaxFrameDimension ||
+      request.height > kMaxFrameDimension) {
+    throw std::invalid_argument("Invalid dimensions in request");
+  }
+  if (request.scale != 1 && request.scale != 2 && request.scale != 4)
+    throw std::invalid_argument("Invalid scale in request");
+  if (request.damage_count > kMaxDamageRects)
+    throw std::invalid_argument("Too many damage rects in request");
+  const std::size_t bytes_per_pixel = GetBytesPerPixel(request.fourcc);
+  FramesconvParams params = params_;
+  params.matrix = CheckEnum(request.matrix, ColorMatrix::kBT2020);
+  params.range = CheckEnum(request.range, ColorRange::kLimited);
+  params.output = CheckEnum(request.output, OutputFormat::kP010);
+  params.targets = {{CheckEnum(request.layout, OutputLayout::kYUYV),
+                     request.scale}};
+  params.dither = request.flags & kConvertDither;
+  const auto& framesconv = GetFramesconv(params);
+  const auto& descriptor = GetLayoutDescriptor(
+      GetScaledSize(request.width, request.scale),
+      GetScaledSize(request.height, request.scale), params.targets[0].layout,
+      params.output);
+
+  // mburakov: Empty aligned rects have nothing to convert.
+  std::vector<DamageRect> damage;
+  for (std::size_t i = 0; i < request.damage_count; i++) {
+    const auto& it = request.damage[i];
+    const auto& rect = framesconv.AlignDamage(
+        {it.x, it.y, it.width, it.height}, request.width, request.height);
+    if (rect.width && rect.height) damage.push_back(rect);
+  }
+
+  // mburakov: Dma-bufs are imported for the duration of the request, while
+  // shared memory is copied through pooled staging buffers.
+  std::optional<GbmBuffer> source_buffer;
+  std::optional<GlTexture> source_texture;
+  BufferPool::Lease source_staging;
+  const GlTexture* source = nullptr;
+  if (request.flags & kConvertSourceMemory) {
+    source_staging =
+        pool_.Acquire(request.width, request.height, request.fourcc);
+    const std::size_t row_size = std::size_t{request.width} * bytes_per_pixel;
+    MemoryStreambuf streambuf(fds[0].get(), row_size * request.height, false);
+    std::istream stream(&streambuf);
+    if (!request.damage_count && !source_staging->buffer.FillFrom(stream))
+      throw std::runtime_error("Shared memory is too small");
+    for (const auto& it : damage) {
+      const std::size_t first_byte = it.x * bytes_per_pixel;
+      stream.seekg(static_cast<std::streamoff>(it.y * row_size + first_byte));
+      source_staging->buffer.FillRectFrom(stream, it.y, it.height, first_byte,
+                                          it.width * bytes_per_pixel, row_size);
+    }
+    source = &source_staging->texture;
+  } else {
+    source_buffer.emplace(fds[0].release(), request.width, request.height,
+                          request.fourcc, request.source_stride,
+                          request.source_offset, request.source_modifier);
+    source = &source_texture.emplace(*source_buffer, context_.GetDisplay());
+  }
+  std::optional<GbmBuffer> destination_buffer;
+  std::optional<GlTexture> destination_texture;
+  BufferPool::Lease destination_staging;
+  GLuint textures_output[1];
+  if (request.flags & kConvertDestinationMemory) {
+    destination_staging = pool_.Acquire(descriptor.width, descriptor.height,
+                                        DRM_FORMAT_ABGR8888);
+    textures_output[0] = destination_staging->texture.Get();
+  } else {
+    destination_buffer.emplace(
+        fds[1].release(), descriptor.width, descriptor.height,
+        DRM_FORMAT_ABGR8888, request.destination_stride,
+        request.destination_offset, request.destination_modifier);
+    textures_output[0] =
+        destination_texture.emplace(*destination_buffer, context_.GetDisplay())
+            .Get();
+  }
+  if (request.damage_count) {
+    framesconv.ConvertDamage(source->Get(), request.width, request.height,
+                             damage, textures_output);
+  } else {
+    framesconv.Convert(source->Get(), request.width, request.height,
+                       textures_output);
+  }
+
+  // mburakov: Staging buffers go back to the pool after the request, so
+  // conversion must be complete before replying if any of them is involved.
+  ConvertReply reply{};
+  reply.cookie = request.cookie;
+  if (!(request.flags & (kConvertSourceMemory | kConvertDestinationMemory)) &&
+      context_.HasNativeFence()) {
+    const auto& fence = context_.CreateNativeFence();
+    const int fence_fd = fence.get();
+    reply.has_fence = 1;
+    SendMessage(client, &reply, sizeof(reply), &fence_fd, 1);
+    return true;
+  }
+  context_.Sync();
+  if (destination_staging) {
+    std::size_t size{};
+    for (std::size_t i = 0; i < descriptor.planes; i++)
+      size += descriptor.plane[i].rows * descriptor.plane[i].bytes;
+    MemoryStreambuf streambuf(fds[1].get(), size, true);
+    std::ostream stream(&streambuf);
+    for (std::size_t i = 0; i < descriptor.planes && !request.damage_count;
+         i++) {
+      const auto& plane = descriptor.plane[i];
+      destination_staging->buffer.DrainTo(stream, plane.row, plane.rows,
+                                          plane.bytes);
+    }
+    for (const auto& it : damage) {
+      DrainDamage(destination_staging->buffer, stream, descriptor, it,
+                  params);
+    }
+  }
+  SendMessage(client, &reply, sizeof(reply));
+  return true;
+}
+
+}  // namespace
+
+void RunDaemon(const GbmDevice& device, const EglContext& context,
+               const char* path, const FramesconvParams& params,
+               std::size_t pool_capacity) {
+  // mburakov: Termination signals are delivered through signalfd, so that the
+  // daemon cleans up after itself.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &signals, nullptr)) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to block signals");
+  }
+  std::unique_ptr<std::nullptr_t, FdCloser> signal_fd{
+      signalfd(-1, &signals, SFD_CLOEXEC)};
+  if (!signal_fd) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to create signalfd");
+  }
+
+  Daemon daemon(device, context, params, pool_capacity);
+  auto listener = ListenUnixSocket(path);
+  Defer deferred_unlink([path] { unlink(path); });
+  std::vector<std::unique_ptr<std::nullptr_t, FdCloser>> clients;
+  for (;;) {
+    std::vector<pollfd> pfds = {{signal_fd.get(), POLLIN, 0},
+                                {listener.get(), POLLIN, 0}};
+    for (const auto& it : clients) pfds.push_back({it.get(), POLLIN, 0});
+    if (poll(pfds.data(), pfds.size(), -1) == -1) {
+      if (errno == EINTR) continue;
+      throw std::system_error(errno, std::system_category(),
+                              "Failed to poll sockets");
+    }
+    if (pfds[0].revents) return;
+
+    // mburakov: Misbehaving clients are dropped without affecting others.
+    for (std::size_t i = pfds.size(); i-- > 2;) {
+      if (!pfds[i].revents) continue;
+      bool connected = false;
+      try {
+        connected = daemon.Serve(pfds[i].fd);
+      } catch (const std::exception& ex) {
+        std::cerr << "Dropping client: " << ex.what() << std::endl;
+      }
+      if (!connected) clients.erase(clients.begin() + (i - 2));
+    }
+    if (pfds[1].revents) clients.push_back(AcceptUnixSocket(listener.get()));
+  }
+}
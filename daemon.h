@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_DAEMON_H_
+#define FRAMESCONV_DAEMON_H_
+
+#include <cstddef>
+
+#include "framesconv.h"
+#include "gpu.h"
+
+// mburakov: Listens on the provided unix socket path and serves ConvertRequest
+// messages of any amount of clients with a single gpu context, until SIGINT or
+// SIGTERM is received. Compiled programs are cached, so that only the first
+// request of a kind pays for their creation, and staging buffers are pooled up
+// to pool_capacity bytes, see BufferPool. Kernel and workgroup size are taken
+// from params. Must be called with egl context current.
+void RunDaemon(const GbmDevice& device, const EglContext& context,
+               const char* path, const FramesconvParams& params,
+               std::size_t pool_capacity);
+
+#endif  // FRAMESCONV_DAEMON_H_
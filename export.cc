@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "export.h"
+
+#include <sys/socket.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "gpu.h"
+#include "protocol.h"
+#include "socket.h"
+#include "utils.h"
+
+namespace {
+
+class ExportSink final : public FrameSink {
+ public:
+  ExportSink(const char* path, std::size_t width, std::size_t height,
+             const LayoutDescriptor& descriptor);
+  ~ExportSink() override;
+
+  // FrameSink
+  bool AcceptsFence() const override { return true; }
+  void Write(const GbmBuffer& buffer, int fence,
+             std::function<void()> release) override;
+  void Flush() override;
+
+ private:
+  void ReceiveReleases();
+
+  std::string path_;
+  std::unique_ptr<const char, SocketUnlinker> unlinker_;
+  std::size_t width_;
+  std::size_t height_;
+  LayoutDescriptor descriptor_;
+  std::unique_ptr<std::nullptr_t, FdCloser> listener_;
+  std::unique_ptr<std::nullptr_t, FdCloser> connection_;
+  std::map<const GbmBuffer*, std::uint32_t> buffer_ids_;
+  std::uint64_t cookie_{};
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<std::uint64_t, std::function<void()>> pending_;
+  bool disconnected_{};
+  std::thread receiver_;
+};
+
+ExportSink::ExportSink(const char* path, std::size_t width, std::size_t height,
+                       const LayoutDescriptor& descriptor)
+    : path_{path},
+      unlinker_{path_.c_str()},
+      width_{width},
+      height_{height},
+      descriptor_{descriptor},
+      listener_{ListenUnixSocket(path)},
+      connection_{AcceptUnixSocket(listener_.get())},
+      receiver_{&ExportSink::ReceiveReleases, this} {}
+
+ExportSink::~ExportSink() {
+  shutdown(connection_.get(), SHUT_RDWR);
+  receiver_.join();
+}
+
+void ExportSink::Write(const GbmBuffer& buffer, int fence,
+                       std::function<void()> release) {
+  auto buffer_id = buffer_ids_.emplace(&buffer, buffer_ids_.size()).first;
+  ExportFrame frame{};
+  frame.cookie = cookie_++;
+  frame.buffer_id = buffer_id->second;
+  frame.has_fence = fence != -1;
+  frame.width = static_cast<std::uint32_t>(width_);
+  frame.height = static_cast<std::uint32_t>(height_);
+  frame.fourcc = descriptor_.fourcc;
+  frame.planes = static_cast<std::uint32_t>(descriptor_.planes);
+  // mburakov: Planes immediately follow each other, and all of them share the
+  // pitch of the underlying rgba buffer.
+  for (std::size_t i = 0; i < descriptor_.planes; i++) {
+    frame.offsets[i] = static_cast<std::uint32_t>(
+        buffer.GetOffset() + buffer.GetStride() * descriptor_.plane[i].row);
+    frame.pitches[i] = static_cast<std::uint32_t>(buffer.GetStride());
+  }
+  frame.modifier = buffer.GetModifier();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (disconnected_) throw std::runtime_error("Consumer disconnected");
+    pending_.emplace(frame.cookie, std::move(release));
+  }
+  try {
+    const int fds[] = {buffer.GetFd(), fence};
+    SendMessage(connection_.get(), &frame, sizeof(frame), fds,
+                frame.has_fence ? 2 : 1);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.erase(frame.cookie);
+    throw;
+  }
+}
+
+void ExportSink::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return pending_.empty(); });
+}
+
+void ExportSink::ReceiveReleases() {
+  // mburakov: Pending entries are erased only after invoking their callbacks,
+  // so that Flush does not return while any of the callbacks is running.
+  auto invoke = [this](std::uint64_t cookie, std::function<void()>& callback) {
+    callback();
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.erase(cookie);
+    cv_.notify_all();
+  };
+
+  try {
+    ExportRelease release{};
+    while (ReceiveMessage(connection_.get(), &release, sizeof(release))) {
+      std::function<void()> callback;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = pending_.find(release.cookie);
+        if (it == pending_.end()) break;
+        callback = it->second;
+      }
+      invoke(release.cookie, callback);
+    }
+  } catch (...) {
+  }
+
+  // mburakov: Any failure on this thread is treated as a disconnection. Buffers
+  // that were not released by consumer are returned to the pipeline, so that it
+  // does not starve, and fails on the next write instead.
+  std::map<std::uint64_t, std::function<void()>> pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    disconnected_ = true;
+    pending = pending_;
+  }
+  for (auto& it : pending) invoke(it.first, it.second);
+}
+
+}  // namespace
+
+std::unique_ptr<FrameSink> CreateExportSink(const char* path,
+                                            std::size_t width,
+                                            std::size_t height,
+                                            OutputLayout layout,
+                                            OutputFormat output) {
+  return std::make_unique<ExportSink>(
+      path, width, height, GetLayoutDescriptor(width, height, layout, output));
+}
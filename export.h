@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_EXPORT_H_
+#define FRAMESCONV_EXPORT_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "pipeline.h"
+
+// mburakov: Listens on the provided unix socket path and waits for a single
+// consumer to connect. Consumer gets ExportFrame messages along with dma-buf
+// fds of the provided layout and fences, and sends ExportRelease messages back,
+// once corresponding dma-bufs could be reused for conversion.
+std::unique_ptr<FrameSink> CreateExportSink(const char* path,
+                                            std::size_t width,
+                                            std::size_t height,
+                                            OutputLayout layout,
+                                            OutputFormat output);
+
+#endif  // FRAMESCONV_EXPORT_H_
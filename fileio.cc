@@ -0,0 +1,513 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fileio.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include "gpu.h"
+#include "utils.h"
+
+namespace {
+
+// mburakov: Amount of requests in flight. Large transfers are split into
+// chunks, so that regular files get a deep enough queue of disk reads.
+constexpr unsigned kQueueDepth = 64;
+constexpr std::size_t kChunkSize = 1 << 20;
+
+// mburakov: Gbm buffers are registered as they show up, replacing the whole
+// set every time, which is fine for a ring of a few buffers.
+constexpr std::size_t kMaxRegisteredBuffers = 32;
+
+// mburakov: Minimal io_uring on top of raw syscalls, only what the sources and
+// sinks below need. Requests are submitted in batches, and every batch is
+// waited for completely.
+class Uring {
+ public:
+  struct Request {
+    std::uint8_t opcode;
+    bool linked;
+    int fd;
+    std::uint64_t offset;
+    char* data;
+    std::size_t size;
+    std::uint16_t buffer_index;
+  };
+
+  // mburakov: Throws if io_uring is not usable.
+  Uring();
+  ~Uring();
+
+  Uring(const Uring&) = delete;
+  Uring(Uring&&) = delete;
+  Uring& operator=(const Uring&) = delete;
+  Uring& operator=(Uring&&) = delete;
+
+  // mburakov: Replaces the set of buffers used by fixed requests. Pinning
+  // memory might be refused, i.e. for mappings of dma-bufs with no struct
+  // pages behind them, in which case false is returned.
+  bool Register(const std::vector<iovec>& buffers);
+  // mburakov: Results are either amounts of transferred bytes or negated
+  // errnos. Linked requests are executed in order, and the rest of the chain is
+  // cancelled once any of them fails or is short.
+  std::vector<int> Run(const std::vector<Request>& requests);
+
+ private:
+  void Enter(unsigned submit, unsigned wait);
+
+  std::unique_ptr<std::nullptr_t, FdCloser> fd_;
+  std::unique_ptr<void, Unmapper> rings_{nullptr, Unmapper{}};
+  std::unique_ptr<void, Unmapper> sqes_{nullptr, Unmapper{}};
+  unsigned* sq_tail_{};
+  unsigned sq_mask_{};
+  unsigned* sq_array_{};
+  unsigned* cq_head_{};
+  unsigned* cq_tail_{};
+  unsigned cq_mask_{};
+  io_uring_cqe* cqes_{};
+  bool registered_{};
+};
+
+Uring::Uring() {
+  io_uring_params params{};
+  fd_.reset(static_cast<int>(syscall(__NR_io_uring_setup, kQueueDepth,
+                                     &params)));
+  if (!fd_) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to setup io_uring");
+  }
+  // mburakov: Sequential transfers on pipes rely on the current position.
+  if (~params.features & IORING_FEAT_SINGLE_MMAP ||
+      ~params.features & IORING_FEAT_RW_CUR_POS) {
+    throw std::runtime_error("Kernel io_uring is too old");
+  }
+  const std::size_t rings_size =
+      std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  void* rings = mmap(nullptr, rings_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd_.get(), IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to mmap io_uring rings");
+  }
+  rings_ = {rings, Unmapper{rings_size}};
+  const std::size_t sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_.get(), IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to mmap io_uring entries");
+  }
+  sqes_ = {sqes, Unmapper{sqes_size}};
+  auto base = static_cast<char*>(rings);
+  sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+}
+
+Uring::~Uring() {
+  if (registered_) {
+    syscall(__NR_io_uring_register, fd_.get(), IORING_UNREGISTER_BUFFERS,
+            nullptr, 0);
+  }
+}
+
+bool Uring::Register(const std::vector<iovec>& buffers) {
+  if (registered_) {
+    syscall(__NR_io_uring_register, fd_.get(), IORING_UNREGISTER_BUFFERS,
+            nullptr, 0);
+    registered_ = false;
+  }
+  registered_ = !syscall(__NR_io_uring_register, fd_.get(),
+                         IORING_REGISTER_BUFFERS, buffers.data(),
+                         static_cast<unsigned>(buffers.size()));
+  return registered_;
+}
+
+std::vector<int> Uring::Run(const std::vector<Request>& requests) {
+  if (requests.size() > kQueueDepth)
+    throw std::logic_error("Too many io_uring requests");
+  auto sqes = static_cast<io_uring_sqe*>(sqes_.get());
+  unsigned tail = *sq_tail_;
+  for (std::size_t i = 0; i < requests.size(); i++, tail++) {
+    const auto& request = requests[i];
+    const unsigned index = tail & sq_mask_;
+    io_uring_sqe& sqe = sqes[index];
+    sqe = {};
+    sqe.opcode = request.opcode;
+    sqe.flags = request.linked ? IOSQE_IO_LINK : 0;
+    sqe.fd = request.fd;
+    sqe.off = request.offset;
+    sqe.addr = reinterpret_cast<std::uintptr_t>(request.data);
+    sqe.len = static_cast<std::uint32_t>(request.size);
+    sqe.buf_index = request.buffer_index;
+    sqe.user_data = i;
+    sq_array_[index] = index;
+  }
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  Enter(static_cast<unsigned>(requests.size()), 0);
+
+  std::vector<int> results(requests.size());
+  for (std::size_t completed = 0; completed < requests.size();) {
+    unsigned head = *cq_head_;
+    const unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    if (head == cq_tail) {
+      Enter(0, 1);
+      continue;
+    }
+    for (; head != cq_tail; head++, completed++) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      results[cqe.user_data] = cqe.res;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  return results;
+}
+
+void Uring::Enter(unsigned submit, unsigned wait) {
+  while (submit || wait) {
+    long result = syscall(__NR_io_uring_enter, fd_.get(), submit, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      throw std::system_error(errno, std::system_category(),
+                              "Failed to enter io_uring");
+    }
+    submit -= static_cast<unsigned>(result);
+    wait = 0;
+  }
+}
+
+// mburakov: Transfers segments of memory to or from the fd, either through
+// io_uring or through plain syscalls. Regular files are accessed with explicit
+// offsets, so that all the chunks are transferred at once, while anything else
+// is accessed sequentially at the current position.
+class FileIo {
+ public:
+  explicit FileIo(int fd);
+
+  bool IsSeekable() const { return offset_.has_value(); }
+  std::uint64_t GetOffset() const { return offset_.value_or(0); }
+  void Register(const void* data, std::size_t size);
+  // mburakov: Returns amount of transferred bytes, that is short only at the
+  // end of file when reading. Offset is advanced by that amount.
+  std::size_t Transfer(bool write, const std::vector<iovec>& segments);
+
+ private:
+  struct Chunk {
+    char* data;
+    std::size_t size;
+    std::uint64_t offset;
+  };
+
+  std::size_t TransferUring(bool write, std::deque<Chunk>& chunks);
+  std::size_t TransferSyscalls(bool write, std::deque<Chunk>& chunks);
+  std::optional<std::uint16_t> FindRegistered(const Chunk& chunk) const;
+
+  int fd_;
+  std::optional<std::uint64_t> offset_;
+  std::optional<Uring> uring_;
+  std::vector<iovec> registered_;
+  bool registration_failed_{};
+};
+
+FileIo::FileIo(int fd) : fd_{fd} {
+  // mburakov: Appending ignores offsets, so such files are sequential too.
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  int flags = fcntl(fd, F_GETFL);
+  if (offset != -1 && flags != -1 && !(flags & O_APPEND))
+    offset_ = static_cast<std::uint64_t>(offset);
+  try {
+    uring_.emplace();
+  } catch (const std::exception&) {
+    // mburakov: Plain syscalls work everywhere.
+  }
+}
+
+void FileIo::Register(const void* data, std::size_t size) {
+  if (!uring_ || registration_failed_) return;
+  for (const auto& it : registered_) {
+    if (it.iov_base == data) return;
+  }
+  if (registered_.size() == kMaxRegisteredBuffers) return;
+  registered_.push_back({const_cast<void*>(data), size});
+  if (!uring_->Register(registered_)) {
+    registration_failed_ = true;
+    registered_.clear();
+  }
+}
+
+std::size_t FileIo::Transfer(bool write, const std::vector<iovec>& segments) {
+  std::deque<Chunk> chunks;
+  std::uint64_t offset = GetOffset();
+  for (const auto& it : segments) {
+    auto data = static_cast<char*>(it.iov_base);
+    for (std::size_t i = 0; i < it.iov_len; i += kChunkSize) {
+      const std::size_t size = std::min(kChunkSize, it.iov_len - i);
+      chunks.push_back({data + i, size, offset});
+      offset += size;
+    }
+  }
+  const std::size_t result =
+      uring_ ? TransferUring(write, chunks) : TransferSyscalls(write, chunks);
+  if (offset_) *offset_ += result;
+  return result;
+}
+
+std::size_t FileIo::TransferUring(bool write, std::deque<Chunk>& chunks) {
+  std::size_t result{};
+  std::vector<Uring::Request> requests;
+  while (!chunks.empty()) {
+    requests.clear();
+    const std::size_t count =
+        std::min(chunks.size(), static_cast<std::size_t>(kQueueDepth));
+    for (std::size_t i = 0; i < count; i++) {
+      const auto& chunk = chunks[i];
+      const auto& buffer_index = FindRegistered(chunk);
+      std::uint8_t opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+      if (buffer_index)
+        opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      // mburakov: Offset of all ones stands for the current position.
+      requests.push_back({opcode, !IsSeekable() && i + 1 < count, fd_,
+                          IsSeekable() ? chunk.offset : ~std::uint64_t{},
+                          chunk.data, chunk.size, buffer_index.value_or(0)});
+    }
+    const auto& results = uring_->Run(requests);
+
+    // mburakov: Short and cancelled chunks are retried in the same order, so
+    // that sequential transfers stay sequential.
+    std::deque<Chunk> retries;
+    bool end_of_file = false;
+    for (std::size_t i = 0; i < count; i++) {
+      const auto& chunk = chunks[i];
+      const int transferred = results[i];
+      if (transferred == -ECANCELED || transferred == -EINTR ||
+          transferred == -EAGAIN) {
+        retries.push_back(chunk);
+        continue;
+      }
+      if (transferred < 0) {
+        throw std::system_error(-transferred, std::system_category(),
+                                write ? "Failed to write file"
+                                      : "Failed to read file");
+      }
+      if (!transferred) {
+        if (write) throw std::runtime_error("Failed to write file");
+        end_of_file = true;
+        continue;
+      }
+      const auto size = static_cast<std::size_t>(transferred);
+      result += size;
+      if (size < chunk.size) {
+        retries.push_back(
+            {chunk.data + size, chunk.size - size, chunk.offset + size});
+      }
+    }
+    if (end_of_file) return result;
+    chunks.erase(chunks.begin(), chunks.begin() + count);
+    chunks.insert(chunks.begin(), retries.begin(), retries.end());
+  }
+  return result;
+}
+
+std::size_t FileIo::TransferSyscalls(bool write, std::deque<Chunk>& chunks) {
+  std::size_t result{};
+  for (auto& chunk : chunks) {
+    while (chunk.size) {
+      ssize_t transferred;
+      if (IsSeekable()) {
+        const auto offset = static_cast<off_t>(chunk.offset);
+        transferred = write ? pwrite(fd_, chunk.data, chunk.size, offset)
+                            : pread(fd_, chunk.data, chunk.size, offset);
+      } else {
+        transferred = write ? ::write(fd_, chunk.data, chunk.size)
+                            : read(fd_, chunk.data, chunk.size);
+      }
+      if (transferred < 0) {
+        if (errno == EINTR) continue;
+        throw std::system_error(errno, std::system_category(),
+                                write ? "Failed to write file"
+                                      : "Failed to read file");
+      }
+      if (!transferred) {
+        if (write) throw std::runtime_error("Failed to write file");
+        return result;
+      }
+      const auto size = static_cast<std::size_t>(transferred);
+      result += size;
+      chunk = {chunk.data + size, chunk.size - size, chunk.offset + size};
+    }
+  }
+  return result;
+}
+
+std::optional<std::uint16_t> FileIo::FindRegistered(const Chunk& chunk) const {
+  for (std::size_t i = 0; i < registered_.size(); i++) {
+    auto begin = static_cast<char*>(registered_[i].iov_base);
+    if (chunk.data >= begin &&
+        chunk.data + chunk.size <= begin + registered_[i].iov_len) {
+      return static_cast<std::uint16_t>(i);
+    }
+  }
+  return std::nullopt;
+}
+
+// mburakov: Tightly packed rows of the mapping, merged if they are contiguous.
+std::vector<iovec> GetRows(char* data, std::size_t stride,
+                           std::size_t first_row, std::size_t rows,
+                           std::size_t row_size) {
+  data += first_row * stride;
+  if (stride == row_size) return {{data, rows * row_size}};
+  std::vector<iovec> result;
+  for (std::size_t row = 0; row < rows; row++)
+    result.push_back({data + row * stride, row_size});
+  return result;
+}
+
+class FileSource final : public FrameSource {
+ public:
+  FileSource(int fd, std::size_t depth);
+  ~FileSource() override;
+
+  // FrameSource
+  const GbmBuffer* Acquire(
+      const GbmBuffer& buffer,
+      std::unique_ptr<std::nullptr_t, FdCloser>* fence) override;
+  void Release(const GbmBuffer*, int) override {}
+
+ private:
+  int fd_;
+  std::size_t depth_;
+  FileIo io_;
+};
+
+FileSource::FileSource(int fd, std::size_t depth)
+    : fd_{fd}, depth_{depth}, io_{fd} {
+  if (io_.IsSeekable()) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+FileSource::~FileSource() {
+  // mburakov: Transfers do not move the position of regular files.
+  if (io_.IsSeekable())
+    lseek(fd_, static_cast<off_t>(io_.GetOffset()), SEEK_SET);
+}
+
+const GbmBuffer* FileSource::Acquire(
+    const GbmBuffer& buffer, std::unique_ptr<std::nullptr_t, FdCloser>*) {
+  auto data = static_cast<char*>(buffer.GetData());
+  io_.Register(data, buffer.GetSize());
+  const std::size_t row_size =
+      buffer.GetWidth() * GetBytesPerPixel(buffer.GetFourcc());
+  const std::size_t frame_size = row_size * buffer.GetHeight();
+  // mburakov: Kernel reads following frames in the background, while this one
+  // is converted.
+  if (io_.IsSeekable()) {
+    posix_fadvise(fd_, static_cast<off_t>(io_.GetOffset() + frame_size),
+                  static_cast<off_t>(frame_size * depth_),
+                  POSIX_FADV_WILLNEED);
+  }
+  buffer.BeginAccess(GbmBuffer::Access::kWrite);
+  Defer deferred_end_access(
+      [&buffer] { buffer.EndAccess(GbmBuffer::Access::kWrite); });
+  const std::size_t transferred = io_.Transfer(
+      false, GetRows(data, buffer.GetStride(), 0, buffer.GetHeight(),
+                     row_size));
+  // mburakov: Clean end of file on a frame boundary is not an error.
+  if (!transferred) return nullptr;
+  if (transferred != frame_size)
+    throw std::runtime_error("Failed to read source");
+  return &buffer;
+}
+
+class FileSink final : public FrameSink {
+ public:
+  FileSink(int fd, const LayoutDescriptor& descriptor)
+      : fd_{fd}, descriptor_{descriptor}, io_{fd} {}
+  ~FileSink() override;
+
+  // FrameSink
+  bool AcceptsFence() const override { return false; }
+  void Write(const GbmBuffer& buffer, int,
+             std::function<void()> release) override;
+  void Flush() override {}
+
+ private:
+  int fd_;
+  LayoutDescriptor descriptor_;
+  FileIo io_;
+};
+
+FileSink::~FileSink() {
+  if (io_.IsSeekable())
+    lseek(fd_, static_cast<off_t>(io_.GetOffset()), SEEK_SET);
+}
+
+void FileSink::Write(const GbmBuffer& buffer, int,
+                     std::function<void()> release) {
+  auto data = static_cast<char*>(buffer.GetData());
+  io_.Register(data, buffer.GetSize());
+  // mburakov: Rows of every plane are trimmed to their packed size.
+  std::vector<iovec> segments;
+  std::size_t size{};
+  for (std::size_t i = 0; i < descriptor_.planes; i++) {
+    const auto& plane = descriptor_.plane[i];
+    const auto& rows = GetRows(data, buffer.GetStride(), plane.row,
+                               plane.rows, plane.bytes);
+    segments.insert(segments.end(), rows.begin(), rows.end());
+    size += plane.rows * plane.bytes;
+  }
+  {
+    buffer.BeginAccess(GbmBuffer::Access::kRead);
+    Defer deferred_end_access(
+        [&buffer] { buffer.EndAccess(GbmBuffer::Access::kRead); });
+    if (io_.Transfer(true, segments) != size)
+      throw std::runtime_error("Failed to write target");
+  }
+  release();
+}
+
+}  // namespace
+
+std::unique_ptr<FrameSource> CreateFileSource(int fd, std::size_t depth) {
+  return std::make_unique<FileSource>(fd, depth);
+}
+
+std::unique_ptr<FrameSink> CreateFileSink(int fd, std::size_t width,
+                                          std::size_t height,
+                                          OutputLayout layout,
+                                          OutputFormat output) {
+  return std::make_unique<FileSink>(
+      fd, GetLayoutDescriptor(width, height, layout, output));
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_FILEIO_H_
+#define FRAMESCONV_FILEIO_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "pipeline.h"
+
+// mburakov: Sources and sinks of raw frames on file descriptors, i.e. files,
+// pipes or standard streams. Fds are not owned. Data is read into and written
+// from the mappings of gbm buffers in place by means of io_uring, without
+// going through any buffering of the standard library. Regular files are read
+// and written with many requests in flight at once, and the kernel is advised
+// to read depth frames ahead, while pipes are served with chains of requests.
+// Requests are only queued for the buffer being filled, because the following
+// buffers of the ring might still be in use, so pipes get no read ahead.
+// Without usable io_uring, i.e. on older kernels or when it is forbidden in
+// the sandbox, plain syscalls are used instead.
+std::unique_ptr<FrameSource> CreateFileSource(int fd, std::size_t depth);
+std::unique_ptr<FrameSink> CreateFileSink(int fd, std::size_t width,
+                                          std::size_t height,
+                                          OutputLayout layout,
+                                          OutputFormat output);
+
+#endif  // FRAMESCONV_FILEIO_H_
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "framesconv.h"
+
+#include <GLES3/gl31.h>
+#include <libdrm/drm_fourcc.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "gpu.h"
+#include "shader.h"
+#include "utils.h"
+
+std::size_t GetNv12Width(std::size_t width) { return (width + 3) / 4; }
+
+std::size_t GetNv12Height(std::size_t height) {
+  return height + (height + 1) / 2;
+}
+
+std::size_t GetScaledSize(std::size_t size, std::size_t scale) {
+  return (size + scale - 1) / scale;
+}
+
+LayoutDescriptor GetLayoutDescriptor(std::size_t width, std::size_t height,
+                                     OutputLayout layout,
+                                     OutputFormat output) {
+  const std::size_t texels = GetNv12Width(width);
+  const std::size_t chroma_width = (width + 1) / 2;
+  const std::size_t chroma_height = (height + 1) / 2;
+  const OutputPlane luma{0, height, width};
+  if (output == OutputFormat::kP010) {
+    if (layout != OutputLayout::kNV12)
+      throw std::invalid_argument("P010 output requires NV12 layout");
+    return {DRM_FORMAT_P010,
+            texels * 2,
+            GetNv12Height(height),
+            2,
+            {{0, height, width * 2},
+             {height, chroma_height, chroma_width * 4}}};
+  }
+  switch (layout) {
+    case OutputLayout::kNV12:
+      return {DRM_FORMAT_NV12,
+              texels,
+              GetNv12Height(height),
+              2,
+              {luma, {height, chroma_height, chroma_width * 2}}};
+    case OutputLayout::kI420:
+      return {DRM_FORMAT_YUV420,
+              texels,
+              height + chroma_height * 2,
+              3,
+              {luma,
+               {height, chroma_height, chroma_width},
+               {height + chroma_height, chroma_height, chroma_width}}};
+    case OutputLayout::kNV16:
+      return {DRM_FORMAT_NV16,
+              texels,
+              height * 2,
+              2,
+              {luma, {height, height, chroma_width * 2}}};
+    case OutputLayout::kNV24:
+      return {DRM_FORMAT_NV24,
+              texels * 2,
+              height * 2,
+              2,
+              {luma, {height, height, width * 2}}};
+    case OutputLayout::kYUYV:
+      return {DRM_FORMAT_YUYV,
+              texels * 2,
+              height,
+              1,
+              {{0, height, chroma_width * 4}}};
+  }
+  throw std::invalid_argument("Invalid output layout");
+}
+
+std::size_t GetPackedNv12Size(std::size_t width, std::size_t height) {
+  return width * height + (width + 1) / 2 * 2 * ((height + 1) / 2);
+}
+
+StatisticsBuffer::StatisticsBuffer() {
+  glGenBuffers(1, &buffer_);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer_);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(StatisticsLayout), nullptr,
+               GL_DYNAMIC_READ);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  if (GLenum error = glGetError(); error != GL_NO_ERROR) {
+    glDeleteBuffers(1, &buffer_);
+    throw std::runtime_error(
+        WrapGlError("Failed to create statistics buffer", error));
+  }
+}
+
+StatisticsBuffer::~StatisticsBuffer() { glDeleteBuffers(1, &buffer_); }
+
+FrameStatistics StatisticsBuffer::Read() const {
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer_);
+  Defer deferred_unbind([] { glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); });
+  const void* data = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0,
+                                      sizeof(StatisticsLayout),
+                                      GL_MAP_READ_BIT);
+  if (!data) {
+    throw std::runtime_error(
+        WrapGlError("Failed to map statistics buffer"));
+  }
+  StatisticsLayout layout;
+  std::memcpy(&layout, data, sizeof(layout));
+  glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+  // mburakov: Mean is derived from the histogram, which is exact, unlike a
+  // sum of samples that would overflow 32-bit atomics on large frames.
+  FrameStatistics result{};
+  std::uint64_t count{}, sum{};
+  for (std::size_t i = 0; i < 256; i++) {
+    result.histogram[i] = layout.histogram[i];
+    count += layout.histogram[i];
+    sum += layout.histogram[i] * i;
+  }
+  result.mean = count ? static_cast<double>(sum) / count : 0.;
+  result.sad = std::uint64_t{layout.sad_high} << 32 | layout.sad_low;
+  result.has_sad = layout.has_sad;
+  return result;
+}
+
+void Framesconv::ConvertBatch(GLuint, std::size_t, std::size_t, std::size_t,
+                              std::size_t, const GLuint*) const {
+  throw std::runtime_error("Batched conversion is not supported");
+}
+
+void Framesconv::ConvertDamage(GLuint texture_rgbx, std::size_t width,
+                               std::size_t height,
+                               const std::vector<DamageRect>&,
+                               const GLuint* textures_output) const {
+  Convert(texture_rgbx, width, height, textures_output);
+}
+
+DamageRect Framesconv::AlignDamage(const DamageRect&, std::size_t width,
+                                   std::size_t height) const {
+  return {0, 0, width, height};
+}
+
+void Framesconv::ConvertStatistics(GLuint, std::size_t, std::size_t,
+                                   const GLuint*, GLuint) const {
+  throw std::runtime_error("Statistics are not supported");
+}
@@ -21,15 +21,201 @@
 #include <GLES3/gl3.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <vector>
 
+enum class ColorMatrix { kBT601, kBT709, kBT2020 };
+enum class ColorRange { kFull, kLimited };
+enum class OutputFormat { kNV12, kP010 };
+enum class OutputLayout { kNV12, kI420, kNV16, kNV24, kYUYV };
+// mburakov: Direct compute kernel fetches pixels of every invocation straight
+// from the source texture, while shared kernel cooperatively loads the whole
+// area of the workgroup into shared memory first. Which one is faster depends
+// on the gpu.
+enum class ComputeKernel { kDirect, kShared };
+
+// mburakov: Every target is bound to a separate image unit, and OpenGL ES 3.1
+// only guarantees four of them for compute shaders.
+constexpr std::size_t kMaxOutputTargets = 4;
+
+// mburakov: Destination of the conversion. Scaled targets are downscaled by
+// scale in both dimensions with box filter, see GetScaledSize. Only NV12
+// targets could be scaled, either by 2 or by 4.
+struct OutputTarget {
+  OutputLayout layout{OutputLayout::kNV12};
+  std::size_t scale{1};
+};
+
+// mburakov: Parameters are baked into shaders at compile time, so that every
+// combination results in a separate specialized program.
+struct FramesconvParams {
+  ColorMatrix matrix{ColorMatrix::kBT709};
+  ColorRange range{ColorRange::kFull};
+  // mburakov: P010 output is only supported by OpenGL ES 3.1 path, and only
+  // with NV12 layouts.
+  OutputFormat output{OutputFormat::kNV12};
+  // mburakov: OpenGL ES 3.1 path writes all the targets from a single read of
+  // the source, other paths only support single unscaled NV12 target.
+  std::vector<OutputTarget> targets{OutputTarget{}};
+  // mburakov: Compute kernel and workgroup dimensions, only used by OpenGL ES
+  // 3.1 path.
+  ComputeKernel kernel{ComputeKernel::kDirect};
+  std::size_t workgroup_width{2};
+  std::size_t workgroup_height{2};
+  // mburakov: Frame statistics are gathered by the conversion itself, see
+  // ConvertStatistics. Only used by OpenGL ES 3.1 path.
+  bool statistics{false};
+  // mburakov: Samples are dithered with fixed ordered pattern before being
+  // quantized, which trades banding of gradients for fine noise that does not
+  // change between frames. Only supported by gpu paths.
+  bool dither{false};
+};
+
+// mburakov: Area of a frame in pixels.
+struct DamageRect {
+  std::size_t x;
+  std::size_t y;
+  std::size_t width;
+  std::size_t height;
+};
+
+// mburakov: Luma statistics of a converted frame. Histogram counts 8-bit luma
+// samples, that are the most significant bits of P010 samples. Sad is the sum
+// of absolute differences of 8-bit luma samples against the frame previously
+// converted with statistics, and is only valid if that frame had the same
+// dimensions.
+struct FrameStatistics {
+  std::uint32_t histogram[256];
+  double mean;
+  std::uint64_t sad;
+  bool has_sad;
+};
+
+// mburakov: Storage buffer statistics of a frame are gathered into. Must be
+// created, read and destroyed with egl context current. Reading blocks until
+// the conversion gathering the statistics is complete.
+class StatisticsBuffer {
+ public:
+  StatisticsBuffer();
+  ~StatisticsBuffer();
+
+  StatisticsBuffer(const StatisticsBuffer&) = delete;
+  StatisticsBuffer(StatisticsBuffer&&) = delete;
+  StatisticsBuffer& operator=(const StatisticsBuffer&) = delete;
+  StatisticsBuffer& operator=(StatisticsBuffer&&) = delete;
+
+  GLuint Get() const { return buffer_; }
+  FrameStatistics Read() const;
+
+ private:
+  GLuint buffer_{};
+};
+
+// mburakov: Destination textures are passed one per target of parameters, in
+// the same order.
 struct Framesconv {
   virtual void Convert(GLuint texture_rgbx, std::size_t width,
-                       std::size_t height, GLuint texture_nv12) const = 0;
+                       std::size_t height,
+                       const GLuint* textures_output) const = 0;
+  // mburakov: Converts count frames of the same dimensions at once. Frames are
+  // tiled in atlases row by row, with columns tiles per row. Source tiles are
+  // width by height pixels, destination tiles are sized according to layout
+  // descriptors. Only OpenGL ES 3.1 path supports batches.
+  virtual void ConvertBatch(GLuint atlas_rgbx, std::size_t width,
+                            std::size_t height, std::size_t columns,
+                            std::size_t count,
+                            const GLuint* atlases_output) const;
+  // mburakov: Converts only damaged areas of the frame, leaving the rest of the
+  // destinations untouched, so that persistent destinations of mostly static
+  // content are updated incrementally. Only the source within damage rects
+  // aligned with AlignDamage is read, and only the corresponding parts of the
+  // destinations are written. Paths not supporting damage convert the whole
+  // frame, and align any damage to the whole frame.
+  virtual void ConvertDamage(GLuint texture_rgbx, std::size_t width,
+                             std::size_t height,
+                             const std::vector<DamageRect>& damage,
+                             const GLuint* textures_output) const;
+  // mburakov: Returns the area of the frame that is actually converted for the
+  // damage rect, aligned outwards to the units of conversion and clipped to the
+  // frame. Start of the area is a multiple of 4 by 2 pixels times the largest
+  // scale of the targets, so that it maps to whole samples of every plane.
+  virtual DamageRect AlignDamage(const DamageRect& rect, std::size_t width,
+                                 std::size_t height) const;
+  // mburakov: Converts the frame like Convert does, additionally gathering its
+  // statistics into provided statistics buffer. Requires statistics parameter.
+  // Only OpenGL ES 3.1 path supports statistics.
+  virtual void ConvertStatistics(GLuint texture_rgbx, std::size_t width,
+                                 std::size_t height,
+                                 const GLuint* textures_output,
+                                 GLuint statistics) const;
   virtual ~Framesconv() = default;
 };
 
-std::unique_ptr<Framesconv> CreateFramesconvES31();
-std::unique_ptr<Framesconv> CreateFramesconvES20();
+// mburakov: NV12 frame is stored in rgba buffer, so that every texel holds 4
+// luma samples, or 2 pairs of chroma samples. Chroma plane follows luma plane.
+// Frames of any dimensions are supported, leftovers of partial texels on the
+// right edge are undefined, and are trimmed when writing packed NV12 data.
+std::size_t GetNv12Width(std::size_t width);
+std::size_t GetNv12Height(std::size_t height);
+
+// mburakov: Dimension of a frame downscaled by scale, rounded up. Pixels on the
+// right and the bottom edges of partially covered boxes are replicated.
+std::size_t GetScaledSize(std::size_t size, std::size_t scale);
+
+// mburakov: Plane of a layout starts at row of the rgba buffer and spans rows
+// rows, sharing the pitch of the buffer with other planes. Only leading bytes
+// of every row belong to the plane.
+struct OutputPlane {
+  std::size_t row;
+  std::size_t rows;
+  std::size_t bytes;
+};
+
+// mburakov: Describes how a frame of provided dimensions is stored in rgba
+// buffer in texels, and how it's trimmed to tightly packed planes. Layouts
+// are stored the same way as NV12 above, with planes following each other.
+// P010 is the NV12 layout with 2 bytes per sample, so that there are twice as
+// many texels per row.
+struct LayoutDescriptor {
+  std::uint32_t fourcc;
+  std::size_t width;
+  std::size_t height;
+  std::size_t planes;
+  OutputPlane plane[3];
+};
+
+LayoutDescriptor GetLayoutDescriptor(std::size_t width, std::size_t height,
+                                     OutputLayout layout, OutputFormat output);
+
+// mburakov: Cpu implementation for hosts without usable gpu. Source is 8-bit
+// rgb with rows stride bytes apart, destination is tightly packed NV12.
+// Arithmetic and rounding follow the gpu implementations, so that outputs
+// match within rounding. Drivers are free to round unorm conversions their own
+// way, so outputs are not guaranteed to be bit-exact.
+struct FramesconvCpu {
+  virtual void Convert(const void* rgbx, std::size_t stride, std::size_t width,
+                       std::size_t height, void* nv12) const = 0;
+  virtual ~FramesconvCpu() = default;
+};
+
+// mburakov: Size of tightly packed NV12 frame. Chroma rows of odd-sized frames
+// hold an extra pair of samples.
+std::size_t GetPackedNv12Size(std::size_t width, std::size_t height);
+
+// mburakov: Amount of shared memory taken by OpenGL ES 3.1 implementation with
+// provided parameters. Creating it fails with invalid_argument if that exceeds
+// GL_MAX_COMPUTE_SHARED_MEMORY_SIZE.
+std::size_t GetSharedMemorySize(const FramesconvParams& params);
+std::unique_ptr<Framesconv> CreateFramesconvES31(
+    const FramesconvParams& params);
+std::unique_ptr<Framesconv> CreateFramesconvES20(
+    const FramesconvParams& params);
+// mburakov: Conversion is split across threads by bands of rows. Zero threads
+// stands for the amount of available cpu cores. Only drm fourccs with 8-bit
+// channels are supported.
+std::unique_ptr<FramesconvCpu> CreateFramesconvCpu(
+    const FramesconvParams& params, std::uint32_t fourcc,
+    std::size_t threads = 0);
 
 #endif  // FRAMESCONV_FRAMESCONV_H_
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <libdrm/drm_fourcc.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "framesconv.h"
+#include "shader.h"
+
+// mburakov: Kernels are written with generic vectors of 16 lanes, that compiler
+// lowers to the best available instructions, i.e. NEON on aarch64. On x86_64
+// kernels are additionally cloned for AVX2 and AVX-512, and the best clone is
+// selected at load time. Helpers are always inlined into the clones, so they
+// never cross function boundaries with vector arguments.
+#if defined(__x86_64__)
+#define FRAMESCONV_KERNEL \
+  __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define FRAMESCONV_KERNEL
+#endif
+#define FRAMESCONV_INLINE inline __attribute__((always_inline))
+
+namespace {
+
+constexpr std::size_t kLanes = 16;
+
+using Bytes = std::uint8_t __attribute__((vector_size(kLanes)));
+using Pixels = std::uint8_t __attribute__((vector_size(kLanes * 4)));
+using Ints = std::int32_t __attribute__((vector_size(kLanes * 4)));
+using Floats = float __attribute__((vector_size(kLanes * 4)));
+using HalfFloats = float __attribute__((vector_size(kLanes * 2)));
+
+// mburakov: Same constants and same order of operations as in shaders.
+struct Coefficients {
+  explicit Coefficients(const FramesconvParams& params) {
+    const auto& color = GetColorCoefficients(params);
+    kr = color.kr;
+    kg = 1.f - color.kr - color.kb;
+    kb = color.kb;
+    u_divisor = 2.f * (1.f - color.kb);
+    v_divisor = 2.f * (1.f - color.kr);
+    y_scale = color.y_scale;
+    y_offset = color.y_offset;
+    uv_scale = color.uv_scale;
+    uv_offset = color.uv_offset;
+  }
+
+  float kr, kg, kb;
+  float u_divisor, v_divisor;
+  float y_scale, y_offset;
+  float uv_scale, uv_offset;
+};
+
+template <typename T>
+struct Yuv {
+  T y, u, v;
+};
+
+// mburakov: Works for scalars and vectors alike, so that vectorized bulk and
+// scalar leftovers produce identical results.
+template <typename T>
+FRAMESCONV_INLINE void RgbToYuv(const T& r, const T& g, const T& b,
+                                const Coefficients& coefficients,
+                                Yuv<T>& yuv) {
+  T y = r * coefficients.kr + g * coefficients.kg + b * coefficients.kb;
+  T u = (b - y) / coefficients.u_divisor;
+  T v = (r - y) / coefficients.v_divisor;
+  yuv.y = y * coefficients.y_scale + coefficients.y_offset;
+  yuv.u = u * coefficients.uv_scale + coefficients.uv_offset;
+  yuv.v = v * coefficients.uv_scale + coefficients.uv_offset;
+}
+
+// mburakov: Unorm conversion as mandated by OpenGL ES for 8-bit targets.
+FRAMESCONV_INLINE std::uint8_t Quantize(float value) {
+  value = std::min(std::max(value, 0.f), 1.f);
+  return static_cast<std::uint8_t>(value * 255.f + .5f);
+}
+
+FRAMESCONV_INLINE void Quantize(const Floats& value, std::uint8_t* target) {
+  const Floats zero{};
+  const Floats one = zero + 1.f;
+  Floats clamped = value < zero ? zero : value;
+  clamped = clamped > one ? one : clamped;
+  Bytes result = __builtin_convertvector(
+      __builtin_convertvector(clamped * 255.f + .5f, Ints), Bytes);
+  std::memcpy(target, &result, sizeof(result));
+}
+
+// mburakov: Red channel is the first one in memory unless bgr is set.
+FRAMESCONV_INLINE void LoadPixel(const std::uint8_t* pixel, bool bgr,
+                                 const Coefficients& coefficients,
+                                 Yuv<float>& yuv) {
+  RgbToYuv(pixel[bgr ? 2 : 0] / 255.f, pixel[1] / 255.f,
+           pixel[bgr ? 0 : 2] / 255.f, coefficients, yuv);
+}
+
+#define FRAMESCONV_LANES(x)                                                   \
+  x, x + 4, x + 8, x + 12, x + 16, x + 20, x + 24, x + 28, x + 32, x + 36,    \
+      x + 40, x + 44, x + 48, x + 52, x + 56, x + 60
+
+FRAMESCONV_INLINE void LoadPixels(const std::uint8_t* pixels, bool bgr,
+                                  const Coefficients& coefficients,
+                                  Yuv<Floats>& yuv) {
+  Pixels data;
+  std::memcpy(&data, pixels, sizeof(data));
+  Bytes r = __builtin_shufflevector(data, data, FRAMESCONV_LANES(0));
+  Bytes g = __builtin_shufflevector(data, data, FRAMESCONV_LANES(1));
+  Bytes b = __builtin_shufflevector(data, data, FRAMESCONV_LANES(2));
+  if (bgr) std::swap(r, b);
+  RgbToYuv(__builtin_convertvector(r, Floats) / 255.f,
+           __builtin_convertvector(g, Floats) / 255.f,
+           __builtin_convertvector(b, Floats) / 255.f, coefficients, yuv);
+}
+
+#undef FRAMESCONV_LANES
+
+// mburakov: Averages chroma of 2x2 pixels in the same order as shaders do.
+FRAMESCONV_INLINE void AverageChroma(const Floats& upper, const Floats& lower,
+                                     HalfFloats& result) {
+  HalfFloats upper_even = __builtin_shufflevector(upper, upper, 0, 2, 4, 6, 8,
+                                                  10, 12, 14);
+  HalfFloats upper_odd = __builtin_shufflevector(upper, upper, 1, 3, 5, 7, 9,
+                                                 11, 13, 15);
+  HalfFloats lower_even = __builtin_shufflevector(lower, lower, 0, 2, 4, 6, 8,
+                                                  10, 12, 14);
+  HalfFloats lower_odd = __builtin_shufflevector(lower, lower, 1, 3, 5, 7, 9,
+                                                 11, 13, 15);
+  result = (upper_even + upper_odd + lower_even + lower_odd) / 4.f;
+}
+
+// mburakov: Converts a pair of source rows into a pair of luma rows and a
+// single chroma row. Lower rows are the same as upper ones on the last row of
+// odd-sized images, and lower luma row is not written in that case.
+FRAMESCONV_KERNEL void ConvertRows(const std::uint8_t* upper,
+                                   const std::uint8_t* lower,
+                                   std::size_t width, bool bgr,
+                                   const Coefficients& coefficients,
+                                   std::uint8_t* luma_upper,
+                                   std::uint8_t* luma_lower,
+                                   std::uint8_t* chroma) {
+  std::size_t x = 0;
+  for (; x + kLanes <= width; x += kLanes) {
+    Yuv<Floats> yuv_upper, yuv_lower;
+    LoadPixels(upper + x * 4, bgr, coefficients, yuv_upper);
+    LoadPixels(lower + x * 4, bgr, coefficients, yuv_lower);
+    Quantize(yuv_upper.y, luma_upper + x);
+    if (luma_lower) Quantize(yuv_lower.y, luma_lower + x);
+    HalfFloats u, v;
+    AverageChroma(yuv_upper.u, yuv_lower.u, u);
+    AverageChroma(yuv_upper.v, yuv_lower.v, v);
+    Quantize(__builtin_shufflevector(u, v, 0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5,
+                                     13, 6, 14, 7, 15),
+             chroma + x);
+  }
+
+  // mburakov: Leftovers are handled pair by pair. The last pair of odd-sized
+  // images replicates the edge pixel.
+  for (; x < width; x += 2) {
+    std::size_t next = std::min(x + 1, width - 1);
+    Yuv<float> yuv0, yuv1, yuv4, yuv5;
+    LoadPixel(upper + x * 4, bgr, coefficients, yuv0);
+    LoadPixel(upper + next * 4, bgr, coefficients, yuv1);
+    LoadPixel(lower + x * 4, bgr, coefficients, yuv4);
+    LoadPixel(lower + next * 4, bgr, coefficients, yuv5);
+    luma_upper[x] = Quantize(yuv0.y);
+    if (next != x) luma_upper[next] = Quantize(yuv1.y);
+    if (luma_lower) {
+      luma_lower[x] = Quantize(yuv4.y);
+      if (next != x) luma_lower[next] = Quantize(yuv5.y);
+    }
+    chroma[x] = Quantize((yuv0.u + yuv1.u + yuv4.u + yuv5.u) / 4.f);
+    chroma[x + 1] = Quantize((yuv0.v + yuv1.v + yuv4.v + yuv5.v) / 4.f);
+  }
+}
+
+class FramesconvCpuImpl final : public FramesconvCpu {
+ public:
+  FramesconvCpuImpl(const FramesconvParams& params, std::uint32_t fourcc,
+                    std::size_t threads);
+  ~FramesconvCpuImpl() override;
+
+  // FramesconvCpu
+  void Convert(const void* rgbx, std::size_t stride, std::size_t width,
+               std::size_t height, void* nv12) const override;
+
+ private:
+  void WorkerLoop(std::size_t band);
+  void Stop();
+
+  const Coefficients coefficients_;
+  const bool bgr_;
+  std::vector<std::thread> workers_;
+
+  // mburakov: Calling thread converts the first band, while every worker
+  // converts its own band of every task.
+  mutable std::mutex mutex_;
+  mutable std::condition_variable task_cv_;
+  mutable std::condition_variable done_cv_;
+  mutable std::function<void(std::size_t)> task_;
+  mutable std::size_t generation_{};
+  mutable std::size_t pending_{};
+  bool stop_{};
+};
+
+bool IsBgr(std::uint32_t fourcc) {
+  switch (fourcc) {
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+      return false;
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+      return true;
+  }
+  throw std::invalid_argument("Unsupported cpu pixel format");
+}
+
+FramesconvCpuImpl::FramesconvCpuImpl(const FramesconvParams& params,
+                                     std::uint32_t fourcc, std::size_t threads)
+    : coefficients_{params}, bgr_{IsBgr(fourcc)} {
+  if (params.output != OutputFormat::kNV12 || params.targets.size() != 1 ||
+      params.targets.front().layout != OutputLayout::kNV12 ||
+      params.targets.front().scale != 1) {
+    throw std::invalid_argument("Cpu implementation only supports NV12");
+  }
+  if (params.dither)
+    throw std::invalid_argument("Cpu implementation does not support dither");
+  if (!threads) threads = std::max(std::thread::hardware_concurrency(), 1u);
+  try {
+    for (std::size_t band = 1; band < threads; band++)
+      workers_.emplace_back(&FramesconvCpuImpl::WorkerLoop, this, band);
+  } catch (...) {
+    Stop();
+    throw;
+  }
+}
+
+FramesconvCpuImpl::~FramesconvCpuImpl() { Stop(); }
+
+void FramesconvCpuImpl::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  task_cv_.notify_all();
+  for (auto& it : workers_) it.join();
+  workers_.clear();
+}
+
+void FramesconvCpuImpl::Convert(const void* rgbx, std::size_t stride,
+                                std::size_t width, std::size_t height,
+                                void* nv12) const {
+  // mburakov: Every band holds whole pairs of rows, because every pair of rows
+  // shares a single chroma row.
+  const std::size_t bands = workers_.size() + 1;
+  const std::size_t pairs = (height + 1) / 2;
+  const std::size_t chroma_stride = (width + 1) / 2 * 2;
+  auto src = static_cast<const std::uint8_t*>(rgbx);
+  auto luma = static_cast<std::uint8_t*>(nv12);
+  auto chroma = luma + width * height;
+  auto convert_band = [&](std::size_t band) {
+    std::size_t first = pairs * band / bands;
+    std::size_t last = pairs * (band + 1) / bands;
+    for (std::size_t pair = first; pair < last; pair++) {
+      std::size_t row = pair * 2;
+      bool partial = row + 1 == height;
+      ConvertRows(src + row * stride, src + (partial ? row : row + 1) * stride,
+                  width, bgr_, coefficients_, luma + row * width,
+                  partial ? nullptr : luma + (row + 1) * width,
+                  chroma + pair * chroma_stride);
+    }
+  };
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = convert_band;
+  generation_++;
+  pending_ = workers_.size();
+  lock.unlock();
+  task_cv_.notify_all();
+  convert_band(0);
+  lock.lock();
+  done_cv_.wait(lock, [this] { return !pending_; });
+  task_ = nullptr;
+}
+
+void FramesconvCpuImpl::WorkerLoop(std::size_t band) {
+  std::size_t generation{};
+  for (;;) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_cv_.wait(lock, [&] { return stop_ || generation_ != generation; });
+    if (stop_) return;
+    generation = generation_;
+    const auto task = task_;
+    lock.unlock();
+    task(band);
+    lock.lock();
+    if (!--pending_) done_cv_.notify_one();
+  }
+}
+
+}  // namespace
+
+std::unique_ptr<FramesconvCpu> CreateFramesconvCpu(
+    const FramesconvParams& params, std::uint32_t fourcc,
+    std::size_t threads) {
+  return std::make_unique<FramesconvCpuImpl>(params, fourcc, threads);
+}
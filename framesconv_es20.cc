@@ -25,16 +25,14 @@
 
 #include "framesconv.h"
 #include "gpu.h"
+#include "shader.h"
 
 namespace {
 
 const auto kVertexShaderSource = R"(
 attribute vec2 position;
 
-varying vec2 dst_upper_left;
-
 void main() {
-  dst_upper_left = position;
   mat4 transform_matrix =
       mat4(vec4(2.0, 0.0, 0.0, 0.0), vec4(0.0, 2.0, 0.0, 0.0),
            vec4(0.0, 0.0, 2.0, 0.0), vec4(-1.0, -1.0, 0.0, 1.0));
@@ -43,37 +41,43 @@ void main() {
 //)";
 
 const auto kFragmentShaderSource = R"(
-uniform sampler2D img_input;
-uniform mediump vec2 img_input_size;
+// mburakov: Sampling coordinates are derived from gl_FragCoord, and mediump
+// precision is not enough to address individual pixels of large images.
+#ifdef GL_FRAGMENT_PRECISION_HIGH
+precision highp float;
+#else
+precision mediump float;
+#endif
 
-varying mediump vec2 dst_upper_left;
+uniform mediump sampler2D img_input;
+uniform vec2 img_input_size;
 
 mediump float rgb2luma(in mediump vec4 rgb) {
-  // mburakov: This hardcodes BT.709 full-range.
-  // mburakov: Note, that the R and B color components are swapped here to align
-  // with the selected GL_ARGB texture format and RGBA format of the source.
-  return rgb.b * 0.2126f + rgb.g * 0.7152f + rgb.r * 0.0722f;
+  // mburakov: KR, KB, Y_SCALE and Y_OFFSET are defined at compile time
+  // according to the selected matrix and range.
+  mediump float y = rgb.r * KR + rgb.g * (1.f - KR - KB) + rgb.b * KB;
+  return y * Y_SCALE + Y_OFFSET;
 }
 
 mediump vec2 rgb2chroma(in mediump vec4 rgb) {
-  // mburakov: This hardcodes BT.709 full-range.
-  // mburakov: Note, that the R and B color components are swapped here to align
-  // with the selected GL_ARGB texture format and RGBA format of the source.
-  mediump float y = rgb.b * 0.2126f + rgb.g * 0.7152f + rgb.r * 0.0722f;
-  mediump float u = (rgb.r - y) / (2.f * (1.f - 0.0722f));
-  mediump float v = (rgb.b - y) / (2.f * (1.f - 0.2126f));
-  return vec2(u + 0.5f, v + 0.5f);
+  // mburakov: KR, KB, UV_SCALE and UV_OFFSET are defined at compile time
+  // according to the selected matrix and range.
+  mediump float y = rgb.r * KR + rgb.g * (1.f - KR - KB) + rgb.b * KB;
+  mediump float u = (rgb.b - y) / (2.f * (1.f - KB));
+  mediump float v = (rgb.r - y) / (2.f * (1.f - KR));
+  return vec2(u * UV_SCALE + UV_OFFSET, v * UV_SCALE + UV_OFFSET);
 }
 
 mediump vec4 handle_luma() {
-  // mburakov: Upper left corner of 4x1 sampling rect.
-  mediump vec2 src_upper_left =
-      vec2(dst_upper_left.x * 4.f, dst_upper_left.y / 2.f * 3.f);
+  // mburakov: Upper left corner of 4x1 sampling rect. Samples beyond the right
+  // edge of odd-sized images are clamped to the edge by the sampler.
+  vec2 src_upper_left =
+      (vec2(floor(gl_FragCoord.x) * 4.f, floor(gl_FragCoord.y)) + 0.5f) /
+      img_input_size;
 
   // mburakov: Sampling offsets.
-  mediump float pix_width = 1.f / img_input_size.x;
-  mediump float pix_height = 1.f / img_input_size.y;
-  mediump vec2 src_offset[4];
+  float pix_width = 1.f / img_input_size.x;
+  vec2 src_offset[4];
   src_offset[0] = vec2(0.f, 0.f);
   src_offset[1] = vec2(pix_width, 0.f);
   src_offset[2] = vec2(pix_width * 2.f, 0.f);
@@ -93,20 +97,25 @@ mediump vec4 handle_luma() {
   luma[2] = rgb2luma(rgb[2]);
   luma[3] = rgb2luma(rgb[3]);
 
-  // mburakov: Writing luma plane with single store.
-  // TODO(mburakov): Why such order? Is it little-endian ARGB?
-  return vec4(luma[0], luma[1], luma[2], luma[3]).bgra;
+  // mburakov: Writing luma plane with single store. Destination is imported as
+  // DRM_FORMAT_ABGR8888, so components are stored in memory order.
+  return vec4(luma[0], luma[1], luma[2], luma[3]);
 }
 
 mediump vec4 handle_chroma() {
-  // mburakov: Upper left corner of 4x2 sampling rect.
-  mediump vec2 src_upper_left =
-      vec2(dst_upper_left.x * 4.f, (dst_upper_left.y - 2.f / 3.f) * 3.f);
+  // mburakov: Upper left corner of 4x2 sampling rect. Chroma plane starts right
+  // after the last row of luma plane. Samples beyond the right and the bottom
+  // edges of odd-sized images are clamped to the edges by the sampler.
+  vec2 src_upper_left =
+      (vec2(floor(gl_FragCoord.x) * 4.f,
+            (floor(gl_FragCoord.y) - img_input_size.y) * 2.f) +
+       0.5f) /
+      img_input_size;
 
   // mburakov: Sampling offsets.
-  mediump float pix_width = 1.f / img_input_size.x;
-  mediump float pix_height = 1.f / img_input_size.y;
-  mediump vec2 src_offset[8];
+  float pix_width = 1.f / img_input_size.x;
+  float pix_height = 1.f / img_input_size.y;
+  vec2 src_offset[8];
   src_offset[0] = vec2(0.f, 0.f);
   src_offset[1] = vec2(pix_width, 0.f);
   src_offset[2] = vec2(pix_width * 2.f, 0.f);
@@ -139,25 +148,50 @@ mediump vec4 handle_chroma() {
   chroma[7] = rgb2chroma(rgb[7]);
 
   // mburakov: Writing chroma plane with single store.
-  // TODO(mburakov): Why such order? Is it little-endian ARGB?
   return vec4((chroma[0] + chroma[1] + chroma[4] + chroma[5]) / 4.f,
-              (chroma[2] + chroma[3] + chroma[6] + chroma[7]) / 4.f).bgra;
+              (chroma[2] + chroma[3] + chroma[6] + chroma[7]) / 4.f);
+}
+
+// mburakov: Ordered dithering follows the one of OpenGL ES 3.1 path, so that
+// outputs match. Every fragment holds 4 horizontally adjacent samples.
+float bayer2(in vec2 position) {
+  return fract(dot(position, vec2(0.5f, position.y * 0.75f)));
+}
+
+float bayer8(in vec2 position) {
+  vec2 half_position = floor(position * 0.5f);
+  vec2 quarter_position = floor(position * 0.25f);
+  return bayer2(quarter_position) * 0.0625f + bayer2(half_position) * 0.25f +
+         bayer2(position);
+}
+
+mediump vec4 dither(in mediump vec4 samples) {
+#ifdef DITHER
+  vec2 origin =
+      mod(vec2(floor(gl_FragCoord.x) * 4.f, floor(gl_FragCoord.y)), 8.f);
+  vec4 thresholds = vec4(bayer8(origin), bayer8(origin + vec2(1.f, 0.f)),
+                         bayer8(origin + vec2(2.f, 0.f)),
+                         bayer8(origin + vec2(3.f, 0.f)));
+  return samples + (thresholds + 0.5f / 64.f - 0.5f) / 255.f;
+#else
+  return samples;
+#endif
 }
 
 void main() {
-  gl_FragColor =
-      (dst_upper_left.y < 2.f / 3.f) ? handle_luma() : handle_chroma();
+  gl_FragColor = dither((gl_FragCoord.y < img_input_size.y) ? handle_luma()
+                                                             : handle_chroma());
 }
 //)";
 
 class FramesconvES20 final : public Framesconv {
  public:
-  FramesconvES20();
+  explicit FramesconvES20(const FramesconvParams& params);
   ~FramesconvES20() override;
 
   // Framesconv
   void Convert(GLuint texture_rgbx, std::size_t width, std::size_t height,
-               GLuint texture_nv12) const override;
+               const GLuint* textures_output) const override;
 
  private:
   GLuint framebuffer_;
@@ -166,7 +200,13 @@ class FramesconvES20 final : public Framesconv {
   GLint img_input_size_;
 };
 
-FramesconvES20::FramesconvES20() {
+FramesconvES20::FramesconvES20(const FramesconvParams& params) {
+  if (params.output != OutputFormat::kNV12 || params.targets.size() != 1 ||
+      params.targets.front().layout != OutputLayout::kNV12 ||
+      params.targets.front().scale != 1) {
+    throw std::invalid_argument("OpenGL ES 2.0 path only supports NV12");
+  }
+
   // mburakov: Create framebuffer.
   GLuint framebuffer{};
   glGenFramebuffers(1, &framebuffer);
@@ -196,7 +236,9 @@ FramesconvES20::FramesconvES20() {
     throw std::runtime_error(WrapGlError("Failed to initialize vbo", error));
 
   // mburakov: Colorspace conversion program.
-  GLuint program = CreateGlProgram(kVertexShaderSource, kFragmentShaderSource);
+  GLuint program = CreateGlProgram(
+      kVertexShaderSource,
+      SpecializeShader(kFragmentShaderSource, params).c_str());
   Defer deferred_gl_delete_program([&program] {
     if (program) glDeleteProgram(program);
   });
@@ -231,10 +273,11 @@ FramesconvES20::~FramesconvES20() {
 }
 
 void FramesconvES20::Convert(GLuint texture_rgbx, std::size_t width,
-                             std::size_t height, GLuint texture_nv12) const {
+                             std::size_t height,
+                             const GLuint* textures_output) const {
   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-                         texture_nv12, 0);
+                         textures_output[0], 0);
   GLenum framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
   if (framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
     glBindBuffer(GL_FRAMEBUFFER, 0);
@@ -244,8 +287,8 @@ void FramesconvES20::Convert(GLuint texture_rgbx, std::size_t width,
     throw std::runtime_error(message);
   }
 
-  glViewport(0, 0, static_cast<GLsizei>(width),
-             static_cast<GLsizei>(height * 3 / 2));
+  glViewport(0, 0, static_cast<GLsizei>(GetNv12Width(width)),
+             static_cast<GLsizei>(GetNv12Height(height)));
 
   glUseProgram(program_);
   glUniform2f(img_input_size_, static_cast<GLfloat>(width),
@@ -268,6 +311,7 @@ void FramesconvES20::Convert(GLuint texture_rgbx, std::size_t width,
 
 }  // namespace
 
-std::unique_ptr<Framesconv> CreateFramesconvES20() {
-  return std::make_unique<FramesconvES20>();
+std::unique_ptr<Framesconv> CreateFramesconvES20(
+    const FramesconvParams& params) {
+  return std::make_unique<FramesconvES20>(params);
 }
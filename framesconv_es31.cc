@@ -15,14 +15,19 @@
  * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <GLES3/gl3.h>
+#include <GLES3/gl31.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "framesconv.h"
 #include "gpu.h"
+#include "shader.h"
 
 namespace {
 
@@ -31,7 +36,7 @@ const auto kComputeShaderSource = R"(
 
 /**
  * mburakov: Following data layouts allow to sample and store data in 4-byte
- * groups. This allows to write nv12 data even though the underlying storage is
+ * groups. This allows to write yuv data even though the underlying storage is
  * accessed as rgba.
  *
  *
@@ -66,102 +71,792 @@ const auto kComputeShaderSource = R"(
 precision mediump image2D;
 
 // mburakov: On *my* hardware workgroup size of 4 (2x2) provides the best
-// performance for this particular compute shader. Note, that's it's unrelated
-// to 4:2:0 chroma subsampling or any layouts mentioned above. When changing
-// workgroup size, don't forget to update all the arguments of glDispatchCompute
-// accordingly, and change the alignment checks in ParseCommandline.
+// performance for this particular compute shader, but it's different across
+// gpus, so it's defined at compile time and could be tuned. Note, that's it's
+// unrelated to 4:2:0 chroma subsampling or any layouts mentioned above.
 
-layout(local_size_x = 2, local_size_y = 2) in;
-layout(rgba8, binding = 0) uniform restrict readonly image2D img_input;
-layout(rgba8, binding = 1) uniform restrict writeonly image2D img_output;
+// mburakov: Source is sampled rather than loaded as an image, so that any
+// source fourcc is converted to normalized rgba by the texture unit. Image
+// formats of OpenGL ES 3.1 can't describe i.e. 10-bit or 16-bit pixels.
+
+layout(local_size_x = WORKGROUP_WIDTH, local_size_y = WORKGROUP_HEIGHT) in;
+layout(binding = 0) uniform highp sampler2D img_input;
+
+// mburakov: Frames are tiled in atlases row by row, atlas_columns tiles per
+// row, and every frame of a batch gets its own layer of invocations. Single
+// frames are batches of one frame.
+layout(location = 0) uniform ivec2 frame_size;
+layout(location = 1) uniform uint atlas_columns;
+
+// mburakov: Damaged areas of the frame are converted by dispatching over the
+// range of invocations covering them, from invocations_origin up to, but not
+// including, invocations_end. Whole frames are ranges covering everything.
+layout(location = 2) uniform uvec2 invocations_origin;
+layout(location = 3) uniform uvec2 invocations_end;
+
+// mburakov: Blocks of BLOCK_WIDTH by 2 pixels are the units of conversion,
+// that are either one 4x2 rect described above, or two of them side by side if
+// any of the targets is I420, because its chroma texels hold samples of 8x2
+// pixels. Pixels of the block are stored row by row.
+#define BLOCK_SIZE (BLOCK_WIDTH * 2)
+
+// mburakov: Every invocation converts INVOCATION_WIDTH by INVOCATION_HEIGHT
+// pixels block by block. Without scaled targets that's a single block, while
+// scaled targets need an area large enough to produce whole texels of their
+// planes, i.e. with scale of 4 it takes 16x8 pixels to produce a single texel
+// of chroma plane. Such invocations accumulate sums of 2x2 pixels cells of the
+// area, so that every scaled target is produced from the same cells.
+#define BLOCKS_X (INVOCATION_WIDTH / BLOCK_WIDTH)
+#define BLOCKS_Y (INVOCATION_HEIGHT / 2)
+#define CELLS_WIDTH (INVOCATION_WIDTH / 2)
+#define CELLS_SIZE (CELLS_WIDTH * INVOCATION_HEIGHT / 2)
+#define SCALED_WIDTH (INVOCATION_WIDTH / SCALE)
+#define SCALED_HEIGHT (INVOCATION_HEIGHT / SCALE)
+
+#ifdef OUTPUT_P010
+// mburakov: P010 samples are 16-bit little-endian words with 10 significant
+// bits at the top. Every rgba8 texel holds a pair of such words, written byte
+// by byte, so that the destination remains a plain rgba8 image. Normalized
+// bytes survive unorm conversion exactly.
+vec4 pack_p010(in vec2 samples) {
+  uvec2 words = uvec2(round(clamp(samples, 0.f, 1.f) * 1023.f)) << 6u;
+  return vec4(uvec4(words.x & 0xffu, words.x >> 8u, words.y & 0xffu,
+                    words.y >> 8u)) /
+         255.f;
+}
+#endif
+
+// mburakov: Ordered dithering offsets every sample by up to half of the
+// quantization step according to 8x8 Bayer matrix, see FramesconvParams. Every
+// texel holds 4 horizontally adjacent samples starting at position.
+float bayer2(in vec2 position) {
+  return fract(dot(position, vec2(0.5f, position.y * 0.75f)));
+}
+
+float bayer8(in vec2 position) {
+  vec2 half_position = floor(position * 0.5f);
+  vec2 quarter_position = floor(position * 0.25f);
+  return bayer2(quarter_position) * 0.0625f + bayer2(half_position) * 0.25f +
+         bayer2(position);
+}
+
+vec4 dither(in ivec2 position, in vec4 samples) {
+#ifdef DITHER
+#ifdef OUTPUT_P010
+  const float kSteps = 1023.f;
+#else
+  const float kSteps = 255.f;
+#endif
+  vec2 origin = vec2(ivec2(position.x * 4, position.y) & 7);
+  vec4 thresholds = vec4(bayer8(origin), bayer8(origin + vec2(1.f, 0.f)),
+                         bayer8(origin + vec2(2.f, 0.f)),
+                         bayer8(origin + vec2(3.f, 0.f)));
+  return samples + (thresholds + 0.5f / 64.f - 0.5f) / kSteps;
+#else
+  return samples;
+#endif
+}
 
 vec3 rgb2yuv(in vec4 rgb) {
-  // mburakov: This hardcodes BT.709 full-range.
-  float y = rgb.r * 0.2126f + rgb.g * 0.7152f + rgb.b * 0.0722f;
-  float u = (rgb.b - y) / (2.f * (1.f - 0.0722f));
-  float v = (rgb.r - y) / (2.f * (1.f - 0.2126f));
-  return vec3(y, u + 0.5f, v + 0.5f);
+  // mburakov: KR, KB, Y_SCALE, Y_OFFSET, UV_SCALE and UV_OFFSET are defined
+  // at compile time according to the selected matrix and range.
+  float y = rgb.r * KR + rgb.g * (1.f - KR - KB) + rgb.b * KB;
+  float u = (rgb.b - y) / (2.f * (1.f - KB));
+  float v = (rgb.r - y) / (2.f * (1.f - KR));
+  return vec3(y * Y_SCALE + Y_OFFSET, u * UV_SCALE + UV_OFFSET,
+              v * UV_SCALE + UV_OFFSET);
+}
+
+// mburakov: Packed 4:2:2 macropixel of a pair of horizontally adjacent pixels.
+vec4 yuyv(in vec3 left, in vec3 right) {
+  return vec4(left.r, (left.g + right.g) / 2.f, right.r,
+              (left.b + right.b) / 2.f);
+}
+//)";
+
+// mburakov: Instantiated for every target, with $ replaced by the index of the
+// target, and with OUTPUT_BINDING, one of LAYOUT_* and, for scaled targets,
+// SCALE defined accordingly. Positions are measured in groups of 4 samples,
+// that take a single texel, or a pair of texels for P010.
+const auto kOutputShaderSource = R"(
+layout(rgba8, binding = OUTPUT_BINDING) uniform restrict writeonly image2D
+    img_output$;
+
+#ifdef OUTPUT_P010
+void store_samples$(in ivec2 position, in vec4 samples) {
+  vec4 dithered = dither(position, samples);
+  imageStore(img_output$, ivec2(position.x * 2, position.y),
+             pack_p010(dithered.xy));
+  imageStore(img_output$, ivec2(position.x * 2 + 1, position.y),
+             pack_p010(dithered.zw));
+}
+#else
+void store_samples$(in ivec2 position, in vec4 samples) {
+  imageStore(img_output$, position, dither(position, samples));
+}
+#endif
+
+#ifndef SCALE
+void store_output$(in uvec2 block, in ivec2 tile, in vec3 yuv[BLOCK_SIZE]) {
+  int groups = (frame_size.x + 3) / 4;
+  int chroma_height = (frame_size.y + 1) / 2;
+
+  // mburakov: Upper left corner of the destination tile.
+#if defined(LAYOUT_NV12)
+  ivec2 origin = tile * ivec2(groups, frame_size.y + chroma_height);
+#elif defined(LAYOUT_I420)
+  ivec2 origin = tile * ivec2(groups, frame_size.y + chroma_height * 2);
+#elif defined(LAYOUT_NV16)
+  ivec2 origin = tile * ivec2(groups, frame_size.y * 2);
+#elif defined(LAYOUT_NV24)
+  ivec2 origin = tile * ivec2(groups * 2, frame_size.y * 2);
+#elif defined(LAYOUT_YUYV)
+  ivec2 origin = tile * ivec2(groups * 2, frame_size.y);
+#endif
+
+  // mburakov: The second row is skipped on the last row of odd-sized frames,
+  // because it belongs to the next plane or to the next tile.
+  int y = int(block.y) * 2;
+  bool lower = y + 1 < frame_size.y;
+
+  for (int i = 0; i < BLOCK_WIDTH / 4; i++) {
+    // mburakov: The second rect of a partial block is not stored at all,
+    // because it would overwrite the neighboring tile.
+    int x = int(block.x) * (BLOCK_WIDTH / 4) + i;
+    if (x >= groups) break;
+    int u = i * 4;
+    int l = u + BLOCK_WIDTH;
+
+#ifndef LAYOUT_YUYV
+    // mburakov: Writing luma plane row by row.
+    store_samples$(origin + ivec2(x, y),
+                   vec4(yuv[u].r, yuv[u + 1].r, yuv[u + 2].r, yuv[u + 3].r));
+    if (lower) {
+      store_samples$(origin + ivec2(x, y + 1),
+                     vec4(yuv[l].r, yuv[l + 1].r, yuv[l + 2].r, yuv[l + 3].r));
+    }
+#endif
+
+#if defined(LAYOUT_NV12)
+    // mburakov: Writing chroma plane with single row.
+    store_samples$(
+        origin + ivec2(x, frame_size.y + int(block.y)),
+        vec4((yuv[u].gb + yuv[u + 1].gb + yuv[l].gb + yuv[l + 1].gb) / 4.f,
+             (yuv[u + 2].gb + yuv[u + 3].gb + yuv[l + 2].gb + yuv[l + 3].gb) /
+                 4.f));
+#elif defined(LAYOUT_NV16)
+    // mburakov: Writing chroma plane row by row, subsampled horizontally.
+    store_samples$(origin + ivec2(x, frame_size.y + y),
+                   vec4((yuv[u].gb + yuv[u + 1].gb) / 2.f,
+                        (yuv[u + 2].gb + yuv[u + 3].gb) / 2.f));
+    if (lower) {
+      store_samples$(origin + ivec2(x, frame_size.y + y + 1),
+                     vec4((yuv[l].gb + yuv[l + 1].gb) / 2.f,
+                          (yuv[l + 2].gb + yuv[l + 3].gb) / 2.f));
+    }
+#elif defined(LAYOUT_NV24)
+    // mburakov: Writing chroma plane row by row, every pixel takes 2 samples.
+    store_samples$(origin + ivec2(x * 2, frame_size.y + y),
+                   vec4(yuv[u].gb, yuv[u + 1].gb));
+    store_samples$(origin + ivec2(x * 2 + 1, frame_size.y + y),
+                   vec4(yuv[u + 2].gb, yuv[u + 3].gb));
+    if (lower) {
+      store_samples$(origin + ivec2(x * 2, frame_size.y + y + 1),
+                     vec4(yuv[l].gb, yuv[l + 1].gb));
+      store_samples$(origin + ivec2(x * 2 + 1, frame_size.y + y + 1),
+                     vec4(yuv[l + 2].gb, yuv[l + 3].gb));
+    }
+#elif defined(LAYOUT_YUYV)
+    // mburakov: Writing the only plane row by row, every pixel takes 2 samples.
+    store_samples$(origin + ivec2(x * 2, y), yuyv(yuv[u], yuv[u + 1]));
+    store_samples$(origin + ivec2(x * 2 + 1, y), yuyv(yuv[u + 2], yuv[u + 3]));
+    if (lower) {
+      store_samples$(origin + ivec2(x * 2, y + 1), yuyv(yuv[l], yuv[l + 1]));
+      store_samples$(origin + ivec2(x * 2 + 1, y + 1),
+                     yuyv(yuv[l + 2], yuv[l + 3]));
+    }
+#endif
+  }
+
+#ifdef LAYOUT_I420
+  // mburakov: Writing chroma planes with single row each. Every texel holds 4
+  // samples of the whole 8x2 block.
+  vec2 uv[4];
+  for (int i = 0; i < 4; i++) {
+    int u = i * 2;
+    int l = u + BLOCK_WIDTH;
+    uv[i] = (yuv[u].gb + yuv[u + 1].gb + yuv[l].gb + yuv[l + 1].gb) / 4.f;
+  }
+  ivec2 position = origin + ivec2(int(block.x), frame_size.y + int(block.y));
+  store_samples$(position, vec4(uv[0].x, uv[1].x, uv[2].x, uv[3].x));
+  store_samples$(position + ivec2(0, chroma_height),
+                 vec4(uv[0].y, uv[1].y, uv[2].y, uv[3].y));
+#endif
+}
+#else
+// mburakov: Scaled pixels are averages of SCALE by SCALE pixels, that is of
+// SCALE / 2 by SCALE / 2 cells.
+vec3 scaled_pixel$(in vec3 cells[CELLS_SIZE], in int x, in int y) {
+  vec3 result = vec3(0.f);
+  for (int i = 0; i < SCALE / 2; i++) {
+    for (int j = 0; j < SCALE / 2; j++) {
+      result +=
+          cells[(y * (SCALE / 2) + i) * CELLS_WIDTH + x * (SCALE / 2) + j];
+    }
+  }
+  return result / float(SCALE * SCALE);
+}
+
+void store_scaled$(in uvec2 invocation, in ivec2 tile,
+                   in vec3 cells[CELLS_SIZE]) {
+  ivec2 size = (frame_size + SCALE - 1) / SCALE;
+  int groups = (size.x + 3) / 4;
+  int chroma_height = (size.y + 1) / 2;
+  ivec2 origin = tile * ivec2(groups, size.y + chroma_height);
+  ivec2 corner = ivec2(invocation) * ivec2(SCALED_WIDTH, SCALED_HEIGHT);
+
+  vec3 yuv[SCALED_WIDTH * SCALED_HEIGHT];
+  for (int y = 0; y < SCALED_HEIGHT; y++) {
+    for (int x = 0; x < SCALED_WIDTH; x++)
+      yuv[y * SCALED_WIDTH + x] = scaled_pixel$(cells, x, y);
+  }
+
+  // mburakov: Writing luma plane row by row. Rows and groups outside of the
+  // scaled frame are not stored, because they belong to the next plane or to
+  // the neighboring tile.
+  for (int y = 0; y < SCALED_HEIGHT; y++) {
+    if (corner.y + y >= size.y) break;
+    for (int x = 0; x < SCALED_WIDTH / 4; x++) {
+      if (corner.x / 4 + x >= groups) break;
+      int u = y * SCALED_WIDTH + x * 4;
+      store_samples$(
+          origin + ivec2(corner.x / 4 + x, corner.y + y),
+          vec4(yuv[u].r, yuv[u + 1].r, yuv[u + 2].r, yuv[u + 3].r));
+    }
+  }
+
+  // mburakov: Writing chroma plane row by row.
+  for (int y = 0; y < SCALED_HEIGHT / 2; y++) {
+    if (corner.y / 2 + y >= chroma_height) break;
+    for (int x = 0; x < SCALED_WIDTH / 4; x++) {
+      if (corner.x / 4 + x >= groups) break;
+      int u = y * 2 * SCALED_WIDTH + x * 4;
+      int l = u + SCALED_WIDTH;
+      store_samples$(
+          origin + ivec2(corner.x / 4 + x, size.y + corner.y / 2 + y),
+          vec4((yuv[u].gb + yuv[u + 1].gb + yuv[l].gb + yuv[l + 1].gb) / 4.f,
+               (yuv[u + 2].gb + yuv[u + 3].gb + yuv[l + 2].gb +
+                yuv[l + 3].gb) /
+                   4.f));
+    }
+  }
+}
+#endif
+//)";
+
+const auto kMainShaderSource = R"(
+#ifdef KERNEL_SHARED
+// mburakov: Workgroup cooperatively loads and converts its whole area into
+// shared memory first, so that neighboring invocations fetch neighboring
+// pixels, and then every invocation reads its blocks from shared memory. Area
+// is stored as separate planes of components to avoid padding of vectors.
+#define AREA_WIDTH (WORKGROUP_WIDTH * INVOCATION_WIDTH)
+#define AREA_HEIGHT (WORKGROUP_HEIGHT * INVOCATION_HEIGHT)
+#define AREA_SIZE (AREA_WIDTH * AREA_HEIGHT)
+shared float area_y[AREA_SIZE];
+shared float area_u[AREA_SIZE];
+shared float area_v[AREA_SIZE];
+
+ivec2 get_area_origin() {
+  uvec2 invocation = gl_WorkGroupID.xy *
+                         uvec2(WORKGROUP_WIDTH, WORKGROUP_HEIGHT) +
+                     invocations_origin;
+  return ivec2(invocation) * ivec2(INVOCATION_WIDTH, INVOCATION_HEIGHT);
+}
+
+// mburakov: Must be called by all the invocations of the workgroup, followed
+// by a barrier in main, because barriers are not allowed in other functions.
+void load_area(in ivec2 src_origin, in ivec2 src_max) {
+  ivec2 area_origin = get_area_origin();
+  for (int i = int(gl_LocalInvocationIndex); i < AREA_SIZE;
+       i += WORKGROUP_WIDTH * WORKGROUP_HEIGHT) {
+    ivec2 position = area_origin + ivec2(i % AREA_WIDTH, i / AREA_WIDTH);
+    vec3 yuv = rgb2yuv(
+        texelFetch(img_input, min(src_origin + position, src_max), 0));
+    area_y[i] = yuv.x;
+    area_u[i] = yuv.y;
+    area_v[i] = yuv.z;
+  }
+}
+
+vec3 fetch_yuv(in ivec2 src_origin, in ivec2 src_max, in ivec2 position) {
+  ivec2 local = position - get_area_origin();
+  int i = local.y * AREA_WIDTH + local.x;
+  return vec3(area_y[i], area_u[i], area_v[i]);
+}
+#else
+vec3 fetch_yuv(in ivec2 src_origin, in ivec2 src_max, in ivec2 position) {
+  return rgb2yuv(
+      texelFetch(img_input, min(src_origin + position, src_max), 0));
+}
+#endif
+
+#ifdef STATISTICS
+// mburakov: Every workgroup reduces statistics of its area in shared memory
+// first, and then adds them to the storage buffer, so that there are only a
+// few global atomics per workgroup. Luma of the frame is kept in another
+// storage buffer, 4 8-bit samples per word, to compute sad against it when
+// converting the next frame. Every word belongs to a single invocation, which
+// reads the previous samples and writes the current ones. Statistics are only
+// gathered if enabled, so that the same program converts frames without them.
+layout(location = 4) uniform bool statistics_enabled;
+layout(std430, binding = 0) restrict buffer Statistics {
+  uint histogram[256];
+  uint sad_low;
+  uint sad_high;
+  uint has_sad;
+} statistics;
+layout(std430, binding = 1) restrict buffer Luma {
+  uint samples[];
+} luma;
+shared uint local_histogram[256];
+shared uint local_sad;
+
+uint quantize_luma(in float y) {
+#ifdef OUTPUT_P010
+  return uint(round(clamp(y, 0.f, 1.f) * 1023.f)) >> 2u;
+#else
+  return uint(round(clamp(y, 0.f, 1.f) * 255.f));
+#endif
+}
+
+void reset_statistics() {
+  for (uint i = gl_LocalInvocationIndex; i < 256u;
+       i += uint(WORKGROUP_WIDTH * WORKGROUP_HEIGHT)) {
+    local_histogram[i] = 0u;
+  }
+  if (gl_LocalInvocationIndex == 0u) local_sad = 0u;
+}
+
+// mburakov: Replicated pixels of partial blocks are not accounted.
+void gather_statistics(in ivec2 src_upper_left, in vec3 yuv[BLOCK_SIZE]) {
+  uint groups = uint(frame_size.x + 3) / 4u;
+  uint sad = 0u;
+  for (int i = 0; i < BLOCK_SIZE; i += 4) {
+    ivec2 position = src_upper_left + ivec2(i % BLOCK_WIDTH, i / BLOCK_WIDTH);
+    if (any(greaterThanEqual(position, frame_size))) continue;
+    uint index = uint(position.y) * groups + uint(position.x) / 4u;
+    uint previous = luma.samples[index];
+    uint current = 0u;
+    for (int j = 0; j < 4 && position.x + j < frame_size.x; j++) {
+      uint value = quantize_luma(yuv[i + j].x);
+      uint shift = uint(j) * 8u;
+      atomicAdd(local_histogram[value], 1u);
+      sad += uint(abs(int(value) - int((previous >> shift) & 0xffu)));
+      current |= value << shift;
+    }
+    luma.samples[index] = current;
+  }
+  atomicAdd(local_sad, sad);
+}
+
+void flush_statistics() {
+  for (uint i = gl_LocalInvocationIndex; i < 256u;
+       i += uint(WORKGROUP_WIDTH * WORKGROUP_HEIGHT)) {
+    if (local_histogram[i] != 0u)
+      atomicAdd(statistics.histogram[i], local_histogram[i]);
+  }
+  // mburakov: Carry of the lower word is detected by its wraparound.
+  if (gl_LocalInvocationIndex == 0u && local_sad != 0u) {
+    uint sad_low = atomicAdd(statistics.sad_low, local_sad);
+    if (sad_low + local_sad < sad_low) atomicAdd(statistics.sad_high, 1u);
+  }
+}
+#endif
+
+void convert(in uvec2 invocation, in ivec2 tile, in ivec2 src_origin,
+             in ivec2 src_max) {
+#ifdef SCALED_TARGETS
+  vec3 cells[CELLS_SIZE];
+  for (int i = 0; i < CELLS_SIZE; i++) cells[i] = vec3(0.f);
+#endif
+
+  for (int by = 0; by < BLOCKS_Y; by++) {
+    for (int bx = 0; bx < BLOCKS_X; bx++) {
+      uvec2 block = invocation * uvec2(BLOCKS_X, BLOCKS_Y) + uvec2(bx, by);
+      ivec2 src_upper_left = ivec2(block) * ivec2(BLOCK_WIDTH, 2);
+
+      // mburakov: Colors of the block after colorspace conversion. Partial
+      // blocks on the right and the bottom edges of odd-sized frames replicate
+      // the edge pixels. Every target reuses the same samples.
+      vec3 yuv[BLOCK_SIZE];
+      for (int i = 0; i < BLOCK_SIZE; i++) {
+        ivec2 offset = ivec2(i % BLOCK_WIDTH, i / BLOCK_WIDTH);
+        yuv[i] = fetch_yuv(src_origin, src_max, src_upper_left + offset);
+      }
+
+      // mburakov: Blocks completely outside of the frame only contribute to
+      // cells of scaled targets.
+      if (all(lessThan(src_upper_left, frame_size))) {
+        STORE_OUTPUTS
+#ifdef STATISTICS
+        if (statistics_enabled) gather_statistics(src_upper_left, yuv);
+#endif
+      }
+
+#ifdef SCALED_TARGETS
+      for (int i = 0; i < BLOCK_SIZE; i++) {
+        int x = bx * BLOCK_WIDTH + i % BLOCK_WIDTH;
+        int y = by * 2 + i / BLOCK_WIDTH;
+        cells[y / 2 * CELLS_WIDTH + x / 2] += yuv[i];
+      }
+#endif
+    }
+  }
+
+#ifdef SCALED_TARGETS
+  STORE_SCALED
+#endif
 }
 
 void main(void) {
-  // mburakov: Upper left corner of 4x2 sampling rect.
-  ivec2 src_upper_left =
-      ivec2(gl_GlobalInvocationID.x * 4u, gl_GlobalInvocationID.y * 2u);
-
-  // mburakov: Sampling offsets.
-  ivec2 src_offset[8] =
-      ivec2[8](ivec2(0, 0), ivec2(1, 0), ivec2(2, 0), ivec2(3, 0), ivec2(0, 1),
-               ivec2(1, 1), ivec2(2, 1), ivec2(3, 1));
-
-  // mburakov: Colors of the 4x2 sampling rect.
-  vec4 rgb[8] = vec4[8](imageLoad(img_input, src_upper_left + src_offset[0]),
-                        imageLoad(img_input, src_upper_left + src_offset[1]),
-                        imageLoad(img_input, src_upper_left + src_offset[2]),
-                        imageLoad(img_input, src_upper_left + src_offset[3]),
-                        imageLoad(img_input, src_upper_left + src_offset[4]),
-                        imageLoad(img_input, src_upper_left + src_offset[5]),
-                        imageLoad(img_input, src_upper_left + src_offset[6]),
-                        imageLoad(img_input, src_upper_left + src_offset[7]));
-
-  // mburakov: Colors after colorspace conversion.
-  vec3 yuv[8] = vec3[8](rgb2yuv(rgb[0]), rgb2yuv(rgb[1]), rgb2yuv(rgb[2]),
-                        rgb2yuv(rgb[3]), rgb2yuv(rgb[4]), rgb2yuv(rgb[5]),
-                        rgb2yuv(rgb[6]), rgb2yuv(rgb[7]));
-
-  // mburakov: Upper left corner of 4x2 storing rect for luma.
-  ivec2 dst_upper_left_luma =
-      ivec2(gl_GlobalInvocationID.x, gl_GlobalInvocationID.y * 2u);
-
-  // mburakov: Writing luma plane with two stores.
-  imageStore(img_output, dst_upper_left_luma + ivec2(0, 0),
-             vec4(yuv[0].r, yuv[1].r, yuv[2].r, yuv[3].r));
-  imageStore(img_output, dst_upper_left_luma + ivec2(0, 1),
-             vec4(yuv[4].r, yuv[5].r, yuv[6].r, yuv[7].r));
-
-  // mburakov: Upper left corner of 2x1 storing rect for chroma.
-  ivec2 img_input_size = imageSize(img_input);
-  ivec2 dst_upper_left_chroma = ivec2(
-      gl_GlobalInvocationID.x, int(gl_GlobalInvocationID.y) + img_input_size.y);
-
-  // mburakov: Writing chroma plane with single store.
-  imageStore(img_output, dst_upper_left_chroma,
-             vec4((yuv[0].gb + yuv[1].gb + yuv[4].gb + yuv[5].gb) / 4.f,
-                  (yuv[2].gb + yuv[3].gb + yuv[6].gb + yuv[7].gb) / 4.f));
+  // mburakov: Upper left corner of the source tile.
+  ivec2 tile = ivec2(gl_GlobalInvocationID.z % atlas_columns,
+                     gl_GlobalInvocationID.z / atlas_columns);
+  ivec2 src_origin = tile * frame_size;
+  ivec2 src_max = src_origin + frame_size - ivec2(1, 1);
+
+#ifdef STATISTICS
+  reset_statistics();
+  memoryBarrierShared();
+  barrier();
+#endif
+
+#ifdef KERNEL_SHARED
+  load_area(src_origin, src_max);
+  memoryBarrierShared();
+  barrier();
+#endif
+
+  // mburakov: Dispatch size is rounded up to the workgroup size, so there might
+  // be invocations completely outside of the range, that must not store
+  // anything, because their parts of the source might be not up to date. They
+  // still take part in barriers, so they do not return early.
+  uvec2 invocation = gl_GlobalInvocationID.xy + invocations_origin;
+  if (all(lessThan(invocation, invocations_end)))
+    convert(invocation, tile, src_origin, src_max);
+
+#ifdef STATISTICS
+  memoryBarrierShared();
+  barrier();
+  if (statistics_enabled) flush_statistics();
+#endif
 }
 //)";
 
+const char* GetLayoutDefine(OutputLayout layout) {
+  switch (layout) {
+    case OutputLayout::kNV12:
+      return "LAYOUT_NV12";
+    case OutputLayout::kI420:
+      return "LAYOUT_I420";
+    case OutputLayout::kNV16:
+      return "LAYOUT_NV16";
+    case OutputLayout::kNV24:
+      return "LAYOUT_NV24";
+    case OutputLayout::kYUYV:
+      return "LAYOUT_YUYV";
+  }
+  throw std::invalid_argument("Invalid output layout");
+}
+
+std::size_t GetBlockWidth(const FramesconvParams& params) {
+  for (const auto& it : params.targets) {
+    if (it.layout == OutputLayout::kI420) return 8;
+  }
+  return 4;
+}
+
+// mburakov: Returns dimensions of the area converted by a single invocation.
+std::pair<std::size_t, std::size_t> GetInvocationSize(
+    const FramesconvParams& params) {
+  std::size_t max_scale = 1;
+  for (const auto& it : params.targets)
+    max_scale = std::max(max_scale, it.scale);
+  return {std::max(GetBlockWidth(params), max_scale * 4), max_scale * 2};
+}
+
+// mburakov: Stores of all the targets are inlined into the single main, so
+// that the source is sampled and converted only once regardless of the amount
+// of targets.
+std::string ComposeShader(const FramesconvParams& params) {
+  if (params.targets.empty() || params.targets.size() > kMaxOutputTargets)
+    throw std::invalid_argument("Invalid amount of output targets");
+  const auto& invocation_size = GetInvocationSize(params);
+  std::string result = kComputeShaderSource;
+  result += "\n#define BLOCK_WIDTH " +
+            std::to_string(GetBlockWidth(params)) + "\n";
+  result += "#define INVOCATION_WIDTH " +
+            std::to_string(invocation_size.first) + "\n";
+  result += "#define INVOCATION_HEIGHT " +
+            std::to_string(invocation_size.second) + "\n";
+  if (invocation_size.second > 2) result += "#define SCALED_TARGETS\n";
+  if (params.statistics) result += "#define STATISTICS\n";
+  if (params.kernel == ComputeKernel::kShared) {
+    GLint max_shared_memory{};
+    glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &max_shared_memory);
+    if (GetSharedMemorySize(params) >
+        static_cast<std::size_t>(max_shared_memory)) {
+      throw std::invalid_argument("Workgroup is too large for shared kernel");
+    }
+    result += "#define KERNEL_SHARED\n";
+  }
+  std::string stores = "#define STORE_OUTPUTS";
+  std::string scaled_stores = "#define STORE_SCALED";
+  for (std::size_t i = 0; i < params.targets.size(); i++) {
+    const auto& target = params.targets[i];
+    if (params.output == OutputFormat::kP010 &&
+        target.layout != OutputLayout::kNV12) {
+      throw std::invalid_argument("P010 output requires NV12 layout");
+    }
+    if (target.scale != 1 && target.scale != 2 && target.scale != 4)
+      throw std::invalid_argument("Scale must be either 1, 2 or 4");
+    if (target.scale != 1 && target.layout != OutputLayout::kNV12)
+      throw std::invalid_argument("Only NV12 targets could be scaled");
+    const auto& index = std::to_string(i);
+    std::string output = kOutputShaderSource;
+    for (auto it = output.find('$'); it != std::string::npos;
+         it = output.find('$', it)) {
+      output.replace(it, 1, index);
+    }
+    const char* define = GetLayoutDefine(target.layout);
+    // mburakov: Source is a sampler, so targets take image units from zero.
+    result += "#define OUTPUT_BINDING " + index + "\n";
+    result += "#define " + std::string(define) + "\n";
+    if (target.scale != 1)
+      result += "#define SCALE " + std::to_string(target.scale) + "\n";
+    result += output + "\n";
+    if (target.scale != 1) result += "#undef SCALE\n";
+    result += "#undef " + std::string(define) + "\n";
+    result += "#undef OUTPUT_BINDING\n";
+    if (target.scale == 1) {
+      stores += " store_output" + index + "(block, tile, yuv);";
+    } else {
+      scaled_stores += " store_scaled" + index;
+      scaled_stores += "(invocation, tile, cells);";
+    }
+  }
+  result += stores + "\n" + scaled_stores + "\n" + kMainShaderSource;
+  return SpecializeShader(result.c_str(), params);
+}
+
 class FramesconvES31 final : public Framesconv {
  public:
-  FramesconvES31();
+  explicit FramesconvES31(const FramesconvParams& params);
   ~FramesconvES31() override;
 
   // Framesconv
   void Convert(GLuint texture_rgbx, std::size_t width, std::size_t height,
-               GLuint texture_nv12) const override;
+               const GLuint* textures_output) const override;
+  void ConvertBatch(GLuint atlas_rgbx, std::size_t width, std::size_t height,
+                    std::size_t columns, std::size_t count,
+                    const GLuint* atlases_output) const override;
+  void ConvertDamage(GLuint texture_rgbx, std::size_t width,
+                     std::size_t height, const std::vector<DamageRect>& damage,
+                     const GLuint* textures_output) const override;
+  DamageRect AlignDamage(const DamageRect& rect, std::size_t width,
+                         std::size_t height) const override;
+  void ConvertStatistics(GLuint texture_rgbx, std::size_t width,
+                         std::size_t height, const GLuint* textures_output,
+                         GLuint statistics) const override;
 
  private:
+  using Invocations = std::pair<std::size_t, std::size_t>;
+
+  void Bind(GLuint atlas_rgbx, std::size_t width, std::size_t height,
+            std::size_t columns, const GLuint* atlases_output) const;
+  // mburakov: Dispatches over invocations in range from origin to end for
+  // count frames. Must be called after Bind.
+  void Dispatch(const Invocations& origin, const Invocations& end,
+                std::size_t count) const;
+  void Finish() const;
+
+  const std::size_t workgroup_width_;
+  const std::size_t workgroup_height_;
+  const std::pair<std::size_t, std::size_t> invocation_size_;
+  const std::size_t targets_;
+  const bool statistics_;
   const GLuint program_;
+  // mburakov: Luma of the frame previously converted with statistics, along
+  // with its dimensions.
+  GLuint luma_buffer_{};
+  mutable std::pair<std::size_t, std::size_t> luma_size_{};
 };
 
-FramesconvES31::FramesconvES31()
-    : program_{CreateGlProgram(kComputeShaderSource)} {}
+FramesconvES31::FramesconvES31(const FramesconvParams& params)
+    : workgroup_width_{params.workgroup_width},
+      workgroup_height_{params.workgroup_height},
+      invocation_size_{GetInvocationSize(params)},
+      targets_{params.targets.size()},
+      statistics_{params.statistics},
+      program_{CreateGlProgram(ComposeShader(params).c_str())} {
+  if (statistics_) glGenBuffers(1, &luma_buffer_);
+}
 
-FramesconvES31::~FramesconvES31() { glDeleteProgram(program_); }
+FramesconvES31::~FramesconvES31() {
+  if (luma_buffer_) glDeleteBuffers(1, &luma_buffer_);
+  glDeleteProgram(program_);
+}
 
 void FramesconvES31::Convert(GLuint texture_rgbx, std::size_t width,
-                             std::size_t height, GLuint texture_nv12) const {
+                             std::size_t height,
+                             const GLuint* textures_output) const {
+  ConvertBatch(texture_rgbx, width, height, 1, 1, textures_output);
+}
+
+void FramesconvES31::ConvertBatch(GLuint atlas_rgbx, std::size_t width,
+                                  std::size_t height, std::size_t columns,
+                                  std::size_t count,
+                                  const GLuint* atlases_output) const {
+  if (!columns || !count)
+    throw std::invalid_argument("Batch must have at least one frame");
+  // mburakov: Every invocation converts an area of invocation_size_ pixels.
+  Bind(atlas_rgbx, width, height, columns, atlases_output);
+  Dispatch({0, 0},
+           {(width + invocation_size_.first - 1) / invocation_size_.first,
+            (height + invocation_size_.second - 1) / invocation_size_.second},
+           count);
+  Finish();
+}
+
+void FramesconvES31::ConvertDamage(GLuint texture_rgbx, std::size_t width,
+                                   std::size_t height,
+                                   const std::vector<DamageRect>& damage,
+                                   const GLuint* textures_output) const {
+  // mburakov: Overlapping rects are converted more than once, which is
+  // harmless, because every invocation stores the same data every time.
+  Bind(texture_rgbx, width, height, 1, textures_output);
+  for (const auto& it : damage) {
+    const auto& rect = AlignDamage(it, width, height);
+    if (!rect.width || !rect.height) continue;
+    Dispatch({rect.x / invocation_size_.first,
+              rect.y / invocation_size_.second},
+             {(rect.x + rect.width + invocation_size_.first - 1) /
+                  invocation_size_.first,
+              (rect.y + rect.height + invocation_size_.second - 1) /
+                  invocation_size_.second},
+             1);
+  }
+  Finish();
+}
+
+DamageRect FramesconvES31::AlignDamage(const DamageRect& rect,
+                                       std::size_t width,
+                                       std::size_t height) const {
+  if (rect.x >= width || rect.y >= height) return {};
+  const std::size_t right = std::min(rect.x + rect.width, width);
+  const std::size_t bottom = std::min(rect.y + rect.height, height);
+  const std::size_t x = rect.x - rect.x % invocation_size_.first;
+  const std::size_t y = rect.y - rect.y % invocation_size_.second;
+  auto align_up = [](std::size_t value, std::size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  };
+  return {x, y,
+          std::min(align_up(right, invocation_size_.first), width) - x,
+          std::min(align_up(bottom, invocation_size_.second), height) - y};
+}
+
+void FramesconvES31::ConvertStatistics(GLuint texture_rgbx, std::size_t width,
+                                       std::size_t height,
+                                       const GLuint* textures_output,
+                                       GLuint statistics) const {
+  if (!statistics_)
+    throw std::logic_error("Statistics were not requested in parameters");
+  // mburakov: Luma buffer is reallocated whenever dimensions change, and sad
+  // is only valid if it was not.
+  StatisticsLayout layout{};
+  layout.has_sad = luma_size_ == std::make_pair(width, height);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, luma_buffer_);
+  if (!layout.has_sad) {
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 static_cast<GLsizeiptr>((width + 3) / 4 * height *
+                                         sizeof(GLuint)),
+                 nullptr, GL_DYNAMIC_COPY);
+    luma_size_ = {width, height};
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, statistics);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(layout), &layout);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, statistics);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, luma_buffer_);
+
+  Bind(texture_rgbx, width, height, 1, textures_output);
+  glUniform1i(4, GL_TRUE);
+  Dispatch({0, 0},
+           {(width + invocation_size_.first - 1) / invocation_size_.first,
+            (height + invocation_size_.second - 1) / invocation_size_.second},
+           1);
+  Finish();
+}
+
+void FramesconvES31::Bind(GLuint atlas_rgbx, std::size_t width,
+                          std::size_t height, std::size_t columns,
+                          const GLuint* atlases_output) const {
   glUseProgram(program_);
-  glBindImageTexture(0, texture_rgbx, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA8);
-  glBindImageTexture(1, texture_nv12, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
-  glDispatchCompute(static_cast<GLuint>(width / 8),
-                    static_cast<GLuint>(height / 4), 1);
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+  glUniform2i(0, static_cast<GLint>(width), static_cast<GLint>(height));
+  glUniform1ui(1, static_cast<GLuint>(columns));
+  if (statistics_) glUniform1i(4, GL_FALSE);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, atlas_rgbx);
+  for (std::size_t i = 0; i < targets_; i++) {
+    glBindImageTexture(static_cast<GLuint>(i), atlases_output[i], 0,
+                       GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+  }
+}
+
+void FramesconvES31::Dispatch(const Invocations& origin,
+                              const Invocations& end,
+                              std::size_t count) const {
+  glUniform2ui(2, static_cast<GLuint>(origin.first),
+               static_cast<GLuint>(origin.second));
+  glUniform2ui(3, static_cast<GLuint>(end.first),
+               static_cast<GLuint>(end.second));
+  glDispatchCompute(
+      static_cast<GLuint>((end.first - origin.first + workgroup_width_ - 1) /
+                          workgroup_width_),
+      static_cast<GLuint>((end.second - origin.second + workgroup_height_ - 1) /
+                          workgroup_height_),
+      static_cast<GLuint>(count));
+}
+
+void FramesconvES31::Finish() const {
+  // mburakov: Statistics are read by mapping, and luma is read by the next
+  // conversion.
+  GLbitfield barriers = GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+  if (statistics_)
+    barriers |= GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT;
+  glMemoryBarrier(barriers);
   if (GLenum error = glGetError(); error != GL_NO_ERROR)
     throw std::runtime_error(WrapGlError("Failed to dispatch compute", error));
 }
 
 }  // namespace
 
-std::unique_ptr<Framesconv> CreateFramesconvES31() {
-  return std::make_unique<FramesconvES31>();
+std::size_t GetSharedMemorySize(const FramesconvParams& params) {
+  // mburakov: Statistics take a histogram and a sad word of shared memory.
+  std::size_t result{};
+  if (params.statistics) result += 257 * sizeof(GLuint);
+  // mburakov: Every pixel of the area takes 3 floats of shared memory.
+  if (params.kernel == ComputeKernel::kShared) {
+    const auto& invocation_size = GetInvocationSize(params);
+    result += params.workgroup_width * invocation_size.first *
+              params.workgroup_height * invocation_size.second * 3 *
+              sizeof(float);
+  }
+  return result;
+}
+
+std::unique_ptr<Framesconv> CreateFramesconvES31(
+    const FramesconvParams& params) {
+  return std::make_unique<FramesconvES31>(params);
 }
@@ -21,14 +21,24 @@
 #include <GLES2/gl2ext.h>
 #include <fcntl.h>
 #include <libdrm/drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <initializer_list>
+#include <iterator>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <system_error>
 #include <utility>
+#include <vector>
 
 namespace {
 
@@ -104,15 +114,161 @@ void CheckBuildable(GLuint buildable) {
   }
 }
 
+// mburakov: On-disk cache of linked program binaries. Every entry is keyed on
+// the gl renderer, gl version and all the shader sources of the program, so
+// that driver upgrades and shader changes naturally result in cache misses.
+class ProgramBinaryCache {
+ public:
+  explicit ProgramBinaryCache(std::initializer_list<const char*> sources);
+
+  // mburakov: Returns zero if there's no cached binary or it was rejected.
+  GLuint Load() const;
+  void PrepareForStore(GLuint program) const;
+  void Store(GLuint program) const;
+
+ private:
+  bool core_{};
+  PFNGLGETPROGRAMBINARYOESPROC get_program_binary_{};
+  PFNGLPROGRAMBINARYOESPROC program_binary_{};
+  std::string path_;
+};
+
+ProgramBinaryCache::ProgramBinaryCache(
+    std::initializer_list<const char*> sources) {
+  // mburakov: Program binaries are core since OpenGL ES 3.0, and available via
+  // GL_OES_get_program_binary in OpenGL ES 2.0 contexts.
+  const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  const char* renderer =
+      reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+  const char* gl_ext =
+      reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+  if (!version || !renderer || !gl_ext) return;
+  int major_version{};
+  std::sscanf(version, "OpenGL ES %d", &major_version);
+  if (major_version >= 3) {
+    core_ = true;
+    get_program_binary_ = &glGetProgramBinary;
+    program_binary_ = &glProgramBinary;
+  } else if (std::string_view(gl_ext).find("GL_OES_get_program_binary") !=
+             std::string_view::npos) {
+    get_program_binary_ = reinterpret_cast<PFNGLGETPROGRAMBINARYOESPROC>(
+        eglGetProcAddress("glGetProgramBinaryOES"));
+    program_binary_ = reinterpret_cast<PFNGLPROGRAMBINARYOESPROC>(
+        eglGetProcAddress("glProgramBinaryOES"));
+  }
+  if (!get_program_binary_ || !program_binary_) return;
+  GLint formats{};
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+  if (formats <= 0) return;
+
+  const auto& cache_dir = GetCacheDir();
+  if (cache_dir.empty()) return;
+  std::uint64_t hash = Fnv1aString(renderer);
+  hash = Fnv1aString(version, hash);
+  for (const char* it : sources) hash = Fnv1aString(it, hash);
+  char name[32];
+  std::snprintf(name, sizeof(name), "/%016" PRIx64 ".bin", hash);
+  path_ = cache_dir + name;
+}
+
+GLuint ProgramBinaryCache::Load() const {
+  if (path_.empty()) return 0;
+  std::ifstream stream(path_, std::ios::binary);
+  GLenum format{};
+  if (!stream.read(reinterpret_cast<char*>(&format), sizeof(format)))
+    return 0;
+  std::vector<char> binary{std::istreambuf_iterator<char>(stream),
+                           std::istreambuf_iterator<char>()};
+  if (binary.empty()) return 0;
+
+  GLuint program = glCreateProgram();
+  if (!program) return 0;
+  program_binary_(program, format, binary.data(),
+                  static_cast<GLint>(binary.size()));
+  GLint status{};
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  // mburakov: Driver is free to reject any binary, i.e. after an upgrade that
+  // did not change the version string. Just fall back to compilation then.
+  if (glGetError() != GL_NO_ERROR || status != GL_TRUE) {
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+void ProgramBinaryCache::PrepareForStore(GLuint program) const {
+  if (core_ && !path_.empty())
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+void ProgramBinaryCache::Store(GLuint program) const {
+  if (path_.empty()) return;
+  GLint length{};
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+  if (glGetError() != GL_NO_ERROR || length <= 0) return;
+  std::vector<char> binary(static_cast<std::size_t>(length));
+  GLenum format{};
+  get_program_binary_(program, length, &length, &format, binary.data());
+  if (glGetError() != GL_NO_ERROR) return;
+
+  // mburakov: Write to a temporary file and rename it, so that concurrently
+  // starting processes never see partially written binaries. Failures are not
+  // fatal, the program is already linked anyway.
+  const auto& temp_path = path_ + "." + std::to_string(getpid());
+  {
+    std::ofstream stream(temp_path, std::ios::binary);
+    stream.write(reinterpret_cast<const char*>(&format), sizeof(format));
+    stream.write(binary.data(), length);
+    if (!stream) {
+      unlink(temp_path.c_str());
+      return;
+    }
+  }
+  if (rename(temp_path.c_str(), path_.c_str())) unlink(temp_path.c_str());
+}
+
 }  // namespace
 
-GbmBuffer::GbmBuffer(gbm_device* device, std::size_t width, std::size_t height)
-    : width_{width}, height_{height} {
-  // mburakov: Implementation uses GBM_BO_FORMAT_ARGB8888 but the exact order
-  // does not really matter. What's important is how it's handled in the shader.
-  bo_.reset(gbm_bo_create(
-      device, static_cast<uint32_t>(width), static_cast<uint32_t>(height),
-      static_cast<uint32_t>(GBM_BO_FORMAT_ARGB8888), GBM_BO_USE_LINEAR));
+std::size_t GetBytesPerPixel(std::uint32_t fourcc) {
+  switch (fourcc) {
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB2101010:
+    case DRM_FORMAT_XBGR2101010:
+      return 4;
+    case DRM_FORMAT_RGB565:
+      return 2;
+  }
+  throw std::invalid_argument("Unsupported pixel format");
+}
+
+GbmBuffer::GbmBuffer(gbm_device* device, std::size_t width, std::size_t height,
+                     std::uint32_t fourcc,
+                     const std::vector<std::uint64_t>& modifiers)
+    : width_{width}, height_{height}, fourcc_{fourcc} {
+  // mburakov: Gbm formats are the same as drm fourccs.
+  GetBytesPerPixel(fourcc);
+  // mburakov: Buffers are described by a single plane everywhere, so
+  // modifiers with auxiliary planes, i.e. compression metadata, are skipped.
+  std::vector<std::uint64_t> single_plane;
+  for (std::uint64_t modifier : modifiers) {
+    if (gbm_device_get_format_modifier_plane_count(device, fourcc, modifier) ==
+        1) {
+      single_plane.push_back(modifier);
+    }
+  }
+  if (single_plane.empty()) {
+    bo_.reset(gbm_bo_create(device, static_cast<uint32_t>(width),
+                            static_cast<uint32_t>(height), fourcc,
+                            GBM_BO_USE_LINEAR));
+  } else {
+    bo_.reset(gbm_bo_create_with_modifiers(
+        device, static_cast<uint32_t>(width), static_cast<uint32_t>(height),
+        fourcc, single_plane.data(),
+        static_cast<unsigned>(single_plane.size())));
+  }
   if (!bo_) {
     throw std::system_error(errno, std::system_category(),
                             "Failed to create gbm buffer object");
@@ -122,43 +278,159 @@ GbmBuffer::GbmBuffer(gbm_device* device, std::size_t width, std::size_t height)
     throw std::system_error(errno, std::system_category(),
                             "Failed to get gbm buffer object fd");
   }
+  stride_ = gbm_bo_get_stride(bo_.get());
+  offset_ = gbm_bo_get_offset(bo_.get(), 0);
+  // mburakov: Linear buffers keep implicit modifier, so that they could be
+  // imported without EGL_EXT_image_dma_buf_import_modifiers.
+  modifier_ = single_plane.empty() ? DRM_FORMAT_MOD_INVALID
+                                   : gbm_bo_get_modifier(bo_.get());
+  if (gbm_bo_get_plane_count(bo_.get()) != 1)
+    throw std::runtime_error("Gbm buffer object has auxiliary planes");
 }
 
-void GbmBuffer::FillFrom(std::istream& stream) const {
-  std::size_t size = width_ * height_ * 4;
-  void* data = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd_.get(), 0);
-  if (data == MAP_FAILED) {
-    throw std::system_error(errno, std::system_category(),
-                            "Failed to mmap gbm buffer object fd");
+GbmBuffer::GbmBuffer(int fd, std::size_t width, std::size_t height,
+                     std::uint32_t fourcc, std::size_t stride,
+                     std::size_t offset, std::uint64_t modifier)
+    : width_{width},
+      height_{height},
+      fourcc_{fourcc},
+      stride_{stride},
+      offset_{offset},
+      modifier_{modifier},
+      fd_{fd} {
+  if (stride < width * GetBytesPerPixel(fourcc))
+    throw std::invalid_argument("Stride is too small");
+}
+
+void* GbmBuffer::GetData() const {
+  if (!data_) {
+    std::size_t size = offset_ + GetSize();
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd_.get(), 0);
+    if (data == MAP_FAILED) {
+      throw std::system_error(errno, std::system_category(),
+                              "Failed to mmap gbm buffer object fd");
+    }
+    data_ = {data, Unmapper{size}};
   }
-  Defer deferred_munmap([data, size] { munmap(data, size); });
-  stream.read(static_cast<char*>(data), static_cast<std::streamsize>(size));
-  if (!stream) throw std::runtime_error("Failed to read source");
+  return static_cast<char*>(data_.get()) + offset_;
 }
 
-void GbmBuffer::DrainTo(std::ostream& stream) const {
-  std::size_t size = width_ * height_ * 4;
-  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_.get(), 0);
-  if (data == MAP_FAILED) {
+void GbmBuffer::BeginAccess(Access access) const {
+  if (!SyncAccess(DMA_BUF_SYNC_START | static_cast<std::uint64_t>(access))) {
     throw std::system_error(errno, std::system_category(),
-                            "Failed to mmap gbm buffer object fd");
+                            "Failed to sync gbm buffer object access");
+  }
+}
+
+void GbmBuffer::EndAccess(Access access) const noexcept {
+  // mburakov: Ending access only fails on invalid arguments, that were already
+  // validated by the matching BeginAccess call. There's nothing to recover
+  // there anyway, so errors are ignored.
+  SyncAccess(DMA_BUF_SYNC_END | static_cast<std::uint64_t>(access));
+}
+
+bool GbmBuffer::SyncAccess(std::uint64_t flags) const noexcept {
+  static_assert(static_cast<std::uint64_t>(Access::kRead) == DMA_BUF_SYNC_READ);
+  static_assert(static_cast<std::uint64_t>(Access::kWrite) ==
+                DMA_BUF_SYNC_WRITE);
+  struct dma_buf_sync sync = {flags};
+  while (ioctl(fd_.get(), DMA_BUF_IOCTL_SYNC, &sync)) {
+    if (errno != EINTR && errno != EAGAIN) return false;
+  }
+  return true;
+}
+
+bool GbmBuffer::FillFrom(std::istream& stream) const {
+  auto data = static_cast<char*>(GetData());
+  BeginAccess(Access::kWrite);
+  Defer deferred_end_access([this] { EndAccess(Access::kWrite); });
+  // mburakov: Source data is tightly packed, while buffer rows might be not.
+  const std::size_t row_size = width_ * GetBytesPerPixel(fourcc_);
+  const std::size_t rows = stride_ == row_size ? 1 : height_;
+  const std::size_t read_size = stride_ == row_size ? GetSize() : row_size;
+  for (std::size_t row = 0; row < rows; row++) {
+    stream.read(data + row * stride_, static_cast<std::streamsize>(read_size));
+    // mburakov: Clean end of stream on a frame boundary is not an error.
+    if (!row && !stream.gcount() && stream.eof()) return false;
+    if (!stream) throw std::runtime_error("Failed to read source");
+  }
+  return true;
+}
+
+void GbmBuffer::DrainTo(std::ostream& stream, std::size_t first_row,
+                        std::size_t rows, std::size_t row_size) const {
+  if (first_row + rows > height_ || row_size > stride_)
+    throw std::invalid_argument("Drained rows are out of buffer bounds");
+  auto data = static_cast<const char*>(GetData()) + first_row * stride_;
+  BeginAccess(Access::kRead);
+  Defer deferred_end_access([this] { EndAccess(Access::kRead); });
+  // mburakov: Target data is tightly packed, while buffer rows might be not.
+  const bool packed = stride_ == row_size;
+  const std::size_t count = packed ? 1 : rows;
+  const std::size_t write_size = packed ? rows * row_size : row_size;
+  for (std::size_t row = 0; row < count; row++) {
+    stream.write(data + row * stride_,
+                 static_cast<std::streamsize>(write_size));
+    if (!stream) throw std::runtime_error("Failed to write target");
+  }
+}
+
+void GbmBuffer::FillRectFrom(std::istream& stream, std::size_t first_row,
+                             std::size_t rows, std::size_t first_byte,
+                             std::size_t bytes, std::size_t pitch) const {
+  if (first_row + rows > height_ || first_byte + bytes > stride_)
+    throw std::invalid_argument("Filled rect is out of buffer bounds");
+  auto data = static_cast<char*>(GetData()) + first_row * stride_ + first_byte;
+  BeginAccess(Access::kWrite);
+  Defer deferred_end_access([this] { EndAccess(Access::kWrite); });
+  for (std::size_t row = 0; row < rows; row++) {
+    if (row) {
+      stream.seekg(static_cast<std::streamoff>(pitch - bytes),
+                   std::ios_base::cur);
+    }
+    stream.read(data + row * stride_, static_cast<std::streamsize>(bytes));
+    if (!stream) throw std::runtime_error("Failed to read source");
+  }
+}
+
+void GbmBuffer::DrainRectTo(std::ostream& stream, std::size_t first_row,
+                            std::size_t rows, std::size_t first_byte,
+                            std::size_t bytes, std::size_t pitch) const {
+  if (first_row + rows > height_ || first_byte + bytes > stride_)
+    throw std::invalid_argument("Drained rect is out of buffer bounds");
+  auto data =
+      static_cast<const char*>(GetData()) + first_row * stride_ + first_byte;
+  BeginAccess(Access::kRead);
+  Defer deferred_end_access([this] { EndAccess(Access::kRead); });
+  for (std::size_t row = 0; row < rows; row++) {
+    if (row) {
+      stream.seekp(static_cast<std::streamoff>(pitch - bytes),
+                   std::ios_base::cur);
+    }
+    stream.write(data + row * stride_, static_cast<std::streamsize>(bytes));
+    if (!stream) throw std::runtime_error("Failed to write target");
   }
-  Defer deferred_munmap([data, size] { munmap(data, size); });
-  stream.write(static_cast<char*>(data), static_cast<std::streamsize>(size));
-  if (!stream) throw std::runtime_error("Failed to write target");
 }
 
 EGLImage GbmBuffer::CreateEglImage(EGLDisplay display) const {
-  // mburakov: Implementation uses DRM_FORMAT_ARGB8888 but the exact order does
-  // not really matter. What's important is how it's handled in the shader.
+  // mburakov: Channels are mapped to rgba components according to the fourcc,
+  // so that shaders do not need to care about the order of channels in memory.
   const EGLAttrib attrib_list[] = {
 #define _(...) __VA_ARGS__
       _(EGL_WIDTH, static_cast<EGLAttrib>(width_)),
       _(EGL_HEIGHT, static_cast<EGLAttrib>(height_)),
-      _(EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_ARGB8888),
+      _(EGL_LINUX_DRM_FOURCC_EXT, static_cast<EGLAttrib>(fourcc_)),
       _(EGL_DMA_BUF_PLANE0_FD_EXT, static_cast<EGLAttrib>(fd_.get())),
-      _(EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0),
-      _(EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLAttrib>(width_ * 4)),
+      _(EGL_DMA_BUF_PLANE0_OFFSET_EXT, static_cast<EGLAttrib>(offset_)),
+      _(EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLAttrib>(stride_)),
+      // mburakov: Implicit modifier terminates the list here.
+      _(modifier_ != DRM_FORMAT_MOD_INVALID
+            ? EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT
+            : EGL_NONE,
+        static_cast<EGLAttrib>(modifier_ & UINT32_MAX)),
+      _(EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+        static_cast<EGLAttrib>(modifier_ >> 32)),
       EGL_NONE,
 #undef _
   };
@@ -169,6 +441,21 @@ EGLImage GbmBuffer::CreateEglImage(EGLDisplay display) const {
   return result;
 }
 
+GlTexture::GlTexture(const GbmBuffer& buffer, EGLDisplay display)
+    : display_{display} {
+  EGLImage image = buffer.CreateEglImage(display);
+  Defer deferred_egl_destroy_image([display, &image] {
+    if (image != EGL_NO_IMAGE) eglDestroyImage(display, image);
+  });
+  texture_ = CreateGlTexture(GL_TEXTURE_2D, image);
+  image_ = std::exchange(image, EGL_NO_IMAGE);
+}
+
+GlTexture::~GlTexture() {
+  glDeleteTextures(1, &texture_);
+  eglDestroyImage(display_, image_);
+}
+
 GbmDevice::GbmDevice(const char* render_node) {
   fd_.reset(open(render_node, O_RDWR));
   if (!fd_) {
@@ -182,20 +469,32 @@ GbmDevice::GbmDevice(const char* render_node) {
   }
 }
 
-GbmBuffer GbmDevice::CreateGbmBuffer(std::size_t width,
-                                     std::size_t height) const {
-  return {device_.get(), width, height};
+GbmBuffer GbmDevice::CreateGbmBuffer(
+    std::size_t width, std::size_t height, std::uint32_t fourcc,
+    const std::vector<std::uint64_t>& modifiers) const {
+  return {device_.get(), width, height, fourcc, modifiers};
 }
 
-EglContext::EglContext(EGLint major_version, EGLint minor_version) {
+EglContext::EglContext(EGLint major_version, EGLint minor_version)
+    : EglContext(EGL_PLATFORM_SURFACELESS_MESA, nullptr,
+                 "EGL_MESA_platform_surfaceless", major_version,
+                 minor_version) {}
+
+EglContext::EglContext(const GbmDevice& device, EGLint major_version,
+                       EGLint minor_version)
+    : EglContext(EGL_PLATFORM_GBM_MESA, device.Get(), "EGL_MESA_platform_gbm",
+                 major_version, minor_version) {}
+
+EglContext::EglContext(EGLenum platform, void* native_display,
+                       const char* extension, EGLint major_version,
+                       EGLint minor_version) {
   const char* egl_ext = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
   if (!egl_ext) {
     throw std::runtime_error(
         WrapEglError("Failed to query platformless egl extensions"));
   }
-  VerifyExtension(egl_ext, "EGL_MESA_platform_surfaceless");
-  EGLDisplay display =
-      eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, nullptr, nullptr);
+  VerifyExtension(egl_ext, extension);
+  EGLDisplay display = eglGetPlatformDisplay(platform, native_display, nullptr);
   if (display == EGL_NO_DISPLAY)
     throw std::runtime_error(WrapEglError("Failed to get platform display"));
   Defer deferred_egl_terminate([&display] {
@@ -215,7 +514,8 @@ EglContext::EglContext(EGLint major_version, EGLint minor_version) {
 
   if (!eglBindAPI(EGL_OPENGL_ES_API))
     throw std::runtime_error(WrapEglError("Failed to bind egl api"));
-  static const EGLint kContextAttribs[] = {
+  // mburakov: Attributes depend on arguments, so they must not be static.
+  const EGLint context_attribs[] = {
 #define _(...) __VA_ARGS__
       _(EGL_CONTEXT_MAJOR_VERSION, major_version),
       _(EGL_CONTEXT_MINOR_VERSION, minor_version),
@@ -223,15 +523,56 @@ EglContext::EglContext(EGLint major_version, EGLint minor_version) {
 #undef _
   };
   context_ = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
-                              kContextAttribs);
+                              context_attribs);
   if (context_ == EGL_NO_CONTEXT)
     throw std::runtime_error(WrapEglError("Failed to create egl context"));
+
+  // mburakov: Native fences are optional.
+  if (std::string_view(egl_ext).find("EGL_ANDROID_native_fence_sync") !=
+      std::string_view::npos) {
+    egl_dup_native_fence_fd_ =
+        reinterpret_cast<PFNEGLDUPNATIVEFENCEFDANDROIDPROC>(
+            eglGetProcAddress("eglDupNativeFenceFDANDROID"));
+  }
+  // mburakov: So are explicit modifiers, linear buffers work without them.
+  if (std::string_view(egl_ext).find(
+          "EGL_EXT_image_dma_buf_import_modifiers") != std::string_view::npos) {
+    egl_query_dma_buf_modifiers_ =
+        reinterpret_cast<PFNEGLQUERYDMABUFMODIFIERSEXTPROC>(
+            eglGetProcAddress("eglQueryDmaBufModifiersEXT"));
+  }
   display_ = std::exchange(display, EGL_NO_DISPLAY);
 }
 
+EglContext::EglContext(const EglContext& share, EGLint major_version,
+                       EGLint minor_version)
+    : display_{share.display_},
+      owns_display_{false},
+      egl_dup_native_fence_fd_{share.egl_dup_native_fence_fd_},
+      egl_query_dma_buf_modifiers_{share.egl_query_dma_buf_modifiers_} {
+  // mburakov: Bound api is a per-thread state.
+  if (!eglBindAPI(EGL_OPENGL_ES_API))
+    throw std::runtime_error(WrapEglError("Failed to bind egl api"));
+  const EGLint context_attribs[] = {
+#define _(...) __VA_ARGS__
+      _(EGL_CONTEXT_MAJOR_VERSION, major_version),
+      _(EGL_CONTEXT_MINOR_VERSION, minor_version),
+      EGL_NONE,
+#undef _
+  };
+  context_ = eglCreateContext(display_, EGL_NO_CONFIG_KHR, share.context_,
+                              context_attribs);
+  if (context_ == EGL_NO_CONTEXT)
+    throw std::runtime_error(WrapEglError("Failed to create egl context"));
+}
+
 EglContext::~EglContext() {
   eglDestroyContext(display_, context_);
-  eglTerminate(display_);
+  if (owns_display_) eglTerminate(display_);
+}
+
+bool EglContext::IsCurrent() const {
+  return eglGetCurrentContext() == context_;
 }
 
 void EglContext::MakeCurrent() const {
@@ -257,6 +598,150 @@ void EglContext::Sync() const {
   eglDestroySync(display_, sync);
 }
 
+EGLSync EglContext::CreateFence() const {
+  EGLSync sync = eglCreateSync(display_, EGL_SYNC_FENCE, nullptr);
+  if (sync == EGL_NO_SYNC)
+    throw std::runtime_error(WrapEglError("Failed to create egl fence sync"));
+  // mburakov: Flush here, because the fence might be waited for from another
+  // thread, where EGL_SYNC_FLUSH_COMMANDS_BIT would have no effect.
+  glFlush();
+  return sync;
+}
+
+void EglContext::WaitFence(EGLSync fence) const {
+  Defer deferred_egl_destroy_sync(
+      [this, fence] { eglDestroySync(display_, fence); });
+  if (eglClientWaitSync(display_, fence, 0, EGL_FOREVER) !=
+      EGL_CONDITION_SATISFIED) {
+    throw std::runtime_error(WrapEglError("Failed to wait egl fence sync"));
+  }
+}
+
+std::unique_ptr<std::nullptr_t, FdCloser> EglContext::CreateNativeFence()
+    const {
+  if (!egl_dup_native_fence_fd_) {
+    throw std::runtime_error(
+        "Required extenstion EGL_ANDROID_native_fence_sync is not supported");
+  }
+  EGLSync sync =
+      eglCreateSync(display_, EGL_SYNC_NATIVE_FENCE_ANDROID, nullptr);
+  if (sync == EGL_NO_SYNC)
+    throw std::runtime_error(WrapEglError("Failed to create egl native fence"));
+  Defer deferred_egl_destroy_sync(
+      [this, sync] { eglDestroySync(display_, sync); });
+  // mburakov: Native fence fd is only available after flushing.
+  glFlush();
+  std::unique_ptr<std::nullptr_t, FdCloser> result{
+      egl_dup_native_fence_fd_(display_, sync)};
+  if (!result)
+    throw std::runtime_error(WrapEglError("Failed to dup native fence fd"));
+  return result;
+}
+
+void EglContext::WaitNativeFence(int fence) const {
+  if (!egl_dup_native_fence_fd_) {
+    pollfd pfd = {fence, POLLIN, 0};
+    while (poll(&pfd, 1, -1) == -1) {
+      if (errno != EINTR) {
+        throw std::system_error(errno, std::system_category(),
+                                "Failed to poll sync_file");
+      }
+    }
+    return;
+  }
+  // mburakov: Egl takes ownership of the fd on success, so it gets a copy.
+  std::unique_ptr<std::nullptr_t, FdCloser> fd{
+      fcntl(fence, F_DUPFD_CLOEXEC, 0)};
+  if (!fd) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to duplicate sync_file");
+  }
+  const EGLAttrib attribs[] = {EGL_SYNC_NATIVE_FENCE_FD_ANDROID,
+                               static_cast<EGLAttrib>(fd.get()), EGL_NONE};
+  EGLSync sync =
+      eglCreateSync(display_, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+  if (sync == EGL_NO_SYNC)
+    throw std::runtime_error(WrapEglError("Failed to import native fence"));
+  fd.release();
+  Defer deferred_egl_destroy_sync(
+      [this, sync] { eglDestroySync(display_, sync); });
+  if (!eglWaitSync(display_, sync, 0))
+    throw std::runtime_error(WrapEglError("Failed to wait native fence"));
+}
+
+std::vector<std::uint64_t> EglContext::QueryModifiers(
+    std::uint32_t fourcc) const {
+  if (!egl_query_dma_buf_modifiers_) return {};
+  const auto format = static_cast<EGLint>(fourcc);
+  EGLint count{};
+  if (!egl_query_dma_buf_modifiers_(display_, format, 0, nullptr, nullptr,
+                                    &count)) {
+    throw std::runtime_error(WrapEglError("Failed to query modifiers count"));
+  }
+  std::vector<EGLuint64KHR> modifiers(static_cast<std::size_t>(count));
+  std::vector<EGLBoolean> external_only(modifiers.size());
+  if (!egl_query_dma_buf_modifiers_(display_, format, count, modifiers.data(),
+                                    external_only.data(), &count)) {
+    throw std::runtime_error(WrapEglError("Failed to query modifiers"));
+  }
+  // mburakov: External only modifiers could not be bound to GL_TEXTURE_2D,
+  // and linear is implied anyway.
+  std::vector<std::uint64_t> result;
+  for (EGLint i = 0; i < count; i++) {
+    if (!external_only[i] && modifiers[i] != DRM_FORMAT_MOD_LINEAR)
+      result.push_back(modifiers[i]);
+  }
+  return result;
+}
+
+GlTimerQuery::GlTimerQuery() {
+  if (!IsSupported()) {
+    throw std::runtime_error(
+        "Required extenstion GL_EXT_disjoint_timer_query is not supported");
+  }
+  gen_queries_ = reinterpret_cast<PFNGLGENQUERIESEXTPROC>(
+      eglGetProcAddress("glGenQueriesEXT"));
+  delete_queries_ = reinterpret_cast<PFNGLDELETEQUERIESEXTPROC>(
+      eglGetProcAddress("glDeleteQueriesEXT"));
+  begin_query_ = reinterpret_cast<PFNGLBEGINQUERYEXTPROC>(
+      eglGetProcAddress("glBeginQueryEXT"));
+  end_query_ = reinterpret_cast<PFNGLENDQUERYEXTPROC>(
+      eglGetProcAddress("glEndQueryEXT"));
+  get_query_object_ = reinterpret_cast<PFNGLGETQUERYOBJECTUI64VEXTPROC>(
+      eglGetProcAddress("glGetQueryObjectui64vEXT"));
+  if (!gen_queries_ || !delete_queries_ || !begin_query_ || !end_query_ ||
+      !get_query_object_) {
+    throw std::runtime_error("Failed to import timer query functions");
+  }
+  gen_queries_(1, &query_);
+  if (!query_)
+    throw std::runtime_error(WrapGlError("Failed to create timer query"));
+}
+
+GlTimerQuery::~GlTimerQuery() { delete_queries_(1, &query_); }
+
+bool GlTimerQuery::IsSupported() {
+  const GLubyte* gl_ext = glGetString(GL_EXTENSIONS);
+  return gl_ext && std::string_view(reinterpret_cast<const char*>(gl_ext))
+                           .find("GL_EXT_disjoint_timer_query") !=
+                       std::string_view::npos;
+}
+
+void GlTimerQuery::Begin() const { begin_query_(GL_TIME_ELAPSED_EXT, query_); }
+
+void GlTimerQuery::End() const { end_query_(GL_TIME_ELAPSED_EXT); }
+
+std::optional<std::uint64_t> GlTimerQuery::GetNanoseconds() const {
+  GLuint64 result{};
+  get_query_object_(query_, GL_QUERY_RESULT_EXT, &result);
+  // mburakov: Disjoint state is reset on reading, so any disruption since the
+  // previous call invalidates the result.
+  GLint disjoint{};
+  glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+  if (disjoint) return std::nullopt;
+  return result;
+}
+
 std::string WrapEglError(const std::string& message, EGLint error) {
   return message + ": " + LookupError(kEglErrors, error);
 }
@@ -266,17 +751,17 @@ std::string WrapGlError(const std::string& message, GLenum error) {
 }
 
 GLuint CreateGlTexture(GLenum target, EGLImage image) {
-  static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES{};
-  if (glEGLImageTargetTexture2DOES == nullptr) {
-    const GLubyte* gl_ext = glGetString(GL_EXTENSIONS);
-    if (!gl_ext) throw std::runtime_error("Failed to get gl extensions");
-    VerifyExtension(reinterpret_cast<const char*>(gl_ext), "GL_OES_EGL_image");
-    glEGLImageTargetTexture2DOES =
-        reinterpret_cast<PFNGLEGLIMAGETARGETTEXTURE2DOESPROC>(
-            eglGetProcAddress("glEGLImageTargetTexture2DOES"));
-    if (!glEGLImageTargetTexture2DOES)
-      throw std::runtime_error("Failed to import glEGLImageTargetTexture2DOES");
-  }
+  // mburakov: Extension support is a property of the current context, while
+  // function pointers returned by egl are context-independent. Function-local
+  // static is initialized exactly once even if called from several threads.
+  const GLubyte* gl_ext = glGetString(GL_EXTENSIONS);
+  if (!gl_ext) throw std::runtime_error("Failed to get gl extensions");
+  VerifyExtension(reinterpret_cast<const char*>(gl_ext), "GL_OES_EGL_image");
+  static const auto glEGLImageTargetTexture2DOES =
+      reinterpret_cast<PFNGLEGLIMAGETARGETTEXTURE2DOESPROC>(
+          eglGetProcAddress("glEGLImageTargetTexture2DOES"));
+  if (!glEGLImageTargetTexture2DOES)
+    throw std::runtime_error("Failed to import glEGLImageTargetTexture2DOES");
 
   GLuint result{};
   glGenTextures(1, &result);
@@ -297,6 +782,9 @@ GLuint CreateGlTexture(GLenum target, EGLImage image) {
 }
 
 GLuint CreateGlProgram(const char* source) {
+  ProgramBinaryCache cache({source});
+  if (GLuint program = cache.Load()) return program;
+
   GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
   if (!shader) throw std::runtime_error(WrapGlError("Failed to create shader"));
   Defer deferred_gl_delete_shader([shader] { glDeleteShader(shader); });
@@ -311,12 +799,17 @@ GLuint CreateGlProgram(const char* source) {
     if (program) glDeleteProgram(program);
   });
   glAttachShader(program, shader);
+  cache.PrepareForStore(program);
   glLinkProgram(program);
   CheckBuildable<GlProgramTraits>(program);
+  cache.Store(program);
   return std::exchange(program, 0);
 }
 
 GLuint CreateGlProgram(const char* source_vertex, const char* source_fragment) {
+  ProgramBinaryCache cache({source_vertex, source_fragment});
+  if (GLuint program = cache.Load()) return program;
+
   GLuint vertex = glCreateShader(GL_VERTEX_SHADER);
   if (!vertex)
     throw std::runtime_error(WrapGlError("Failed to create vertex shader"));
@@ -342,7 +835,9 @@ GLuint CreateGlProgram(const char* source_vertex, const char* source_fragment) {
   });
   glAttachShader(program, vertex);
   glAttachShader(program, fragment);
+  cache.PrepareForStore(program);
   glLinkProgram(program);
   CheckBuildable<GlProgramTraits>(program);
+  cache.Store(program);
   return std::exchange(program, 0);
 }
@@ -19,38 +19,125 @@
 #define FRAMESCONV_GPU_H_
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES3/gl31.h>
+#include <GLES2/gl2ext.h>
 #include <gbm.h>
+#include <libdrm/drm_fourcc.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <istream>
 #include <memory>
+#include <optional>
 #include <ostream>
 #include <string>
+#include <vector>
 
 #include "utils.h"
 
+// mburakov: Returns size of a pixel of single-plane rgb format, or throws if
+// the format is not supported.
+std::size_t GetBytesPerPixel(std::uint32_t fourcc);
+
+// mburakov: Largest width or height of frames accepted from files and clients,
+// which keeps sizes of their buffers far from overflowing.
+constexpr std::size_t kMaxFrameDimension = 16384;
+
 class GbmBuffer {
  public:
-  GbmBuffer(gbm_device* device, std::size_t width, std::size_t height);
-
-  void FillFrom(std::istream& stream) const;
-  void DrainTo(std::ostream& stream) const;
+  enum class Access { kRead = 1, kWrite = 2, kReadWrite = 3 };
+
+  // mburakov: Allocates a linear buffer, unless some of the provided modifiers
+  // could be used, in which case gbm picks the most efficient of them. Cpu
+  // access to the data of tiled buffers makes no sense.
+  GbmBuffer(gbm_device* device, std::size_t width, std::size_t height,
+            std::uint32_t fourcc,
+            const std::vector<std::uint64_t>& modifiers = {});
+  // mburakov: Wraps externally allocated dma-buf, taking ownership of the fd.
+  // Pass DRM_FORMAT_MOD_INVALID as modifier if it is implicit.
+  GbmBuffer(int fd, std::size_t width, std::size_t height, std::uint32_t fourcc,
+            std::size_t stride, std::size_t offset, std::uint64_t modifier);
+
+  // mburakov: Buffer is mapped on the first call and stays mapped for the
+  // lifetime of the object. Any cpu access to the mapped data must be enclosed
+  // between BeginAccess and EndAccess calls with matching access flags.
+  // EndAccess never throws, so that it can be deferred.
+  void* GetData() const;
+  std::size_t GetSize() const { return stride_ * height_; }
+  std::size_t GetWidth() const { return width_; }
+  std::size_t GetHeight() const { return height_; }
+  std::uint32_t GetFourcc() const { return fourcc_; }
+  std::size_t GetStride() const { return stride_; }
+  std::size_t GetOffset() const { return offset_; }
+  std::uint64_t GetModifier() const { return modifier_; }
+  int GetFd() const { return fd_.get(); }
+  void BeginAccess(Access access) const;
+  void EndAccess(Access access) const noexcept;
+
+  bool FillFrom(std::istream& stream) const;
+  // mburakov: Writes rows starting from first_row, trimming them to row_size.
+  void DrainTo(std::ostream& stream, std::size_t first_row, std::size_t rows,
+               std::size_t row_size) const;
+  // mburakov: Copy a rect of rows rows, starting from first_row, and of bytes
+  // bytes, starting from first_byte of every row. Stream is positioned at the
+  // beginning of the rect, and is advanced by pitch bytes from one row of the
+  // rect to the next, so it must be seekable.
+  void FillRectFrom(std::istream& stream, std::size_t first_row,
+                    std::size_t rows, std::size_t first_byte,
+                    std::size_t bytes, std::size_t pitch) const;
+  void DrainRectTo(std::ostream& stream, std::size_t first_row,
+                   std::size_t rows, std::size_t first_byte, std::size_t bytes,
+                   std::size_t pitch) const;
   EGLImage CreateEglImage(EGLDisplay display) const;
 
  private:
+  bool SyncAccess(std::uint64_t flags) const noexcept;
+
   std::size_t width_{};
   std::size_t height_{};
+  std::uint32_t fourcc_{};
+  std::size_t stride_{};
+  std::size_t offset_{};
+  std::uint64_t modifier_{};
   std::unique_ptr<gbm_bo, decltype(&gbm_bo_destroy)> bo_{nullptr,
                                                          &gbm_bo_destroy};
   std::unique_ptr<std::nullptr_t, FdCloser> fd_;
+  mutable std::unique_ptr<void, Unmapper> data_{nullptr, Unmapper{}};
+};
+
+// mburakov: Egl image created from gbm buffer, along with gl texture bound to
+// it. Must be created and destroyed with egl context current.
+class GlTexture {
+ public:
+  GlTexture(const GbmBuffer& buffer, EGLDisplay display);
+  ~GlTexture();
+
+  GlTexture(const GlTexture&) = delete;
+  GlTexture(GlTexture&& other) = delete;
+  GlTexture& operator=(const GlTexture&) = delete;
+  GlTexture& operator=(GlTexture&& other) = delete;
+
+  GLuint Get() const { return texture_; }
+
+ private:
+  EGLDisplay display_;
+  EGLImage image_;
+  GLuint texture_;
 };
 
 class GbmDevice {
  public:
   explicit GbmDevice(const char* render_node);
 
-  GbmBuffer CreateGbmBuffer(std::size_t width, std::size_t height) const;
+  // mburakov: Destination buffers are always DRM_FORMAT_ABGR8888, so that the
+  // memory order of channels matches the order of rgba components in shaders.
+  // Buffers that are accessed by cpu must not be given any modifiers.
+  GbmBuffer CreateGbmBuffer(
+      std::size_t width, std::size_t height,
+      std::uint32_t fourcc = DRM_FORMAT_ABGR8888,
+      const std::vector<std::uint64_t>& modifiers = {}) const;
+  gbm_device* Get() const { return device_.get(); }
 
  private:
   std::unique_ptr<std::nullptr_t, FdCloser> fd_;
@@ -60,7 +147,16 @@ class GbmDevice {
 
 class EglContext {
  public:
+  // mburakov: Surfaceless platform picks the gpu on its own, while gbm
+  // platform uses the gpu of the provided device, which allows using
+  // several gpus at once.
   EglContext(EGLint major_version, EGLint minor_version);
+  EglContext(const GbmDevice& device, EGLint major_version,
+             EGLint minor_version);
+  // mburakov: Creates another context on the display of share, sharing gl
+  // objects with it. Display must outlive all the contexts sharing it.
+  EglContext(const EglContext& share, EGLint major_version,
+             EGLint minor_version);
   ~EglContext();
 
   EglContext(const EglContext&) = delete;
@@ -71,11 +167,61 @@ class EglContext {
   EGLDisplay GetDisplay() const { return display_; }
   void MakeCurrent() const;
   void ResetCurrent() const;
+  bool IsCurrent() const;
   void Sync() const;
+  EGLSync CreateFence() const;
+  void WaitFence(EGLSync fence) const;
+  // mburakov: Native fences require EGL_ANDROID_native_fence_sync. Returned fd
+  // is a sync_file that could be polled or passed to another process.
+  bool HasNativeFence() const { return egl_dup_native_fence_fd_; }
+  std::unique_ptr<std::nullptr_t, FdCloser> CreateNativeFence() const;
+  // mburakov: Makes gpu wait for provided sync_file before executing commands
+  // issued afterwards, without blocking the calling thread. Without native
+  // fences support it falls back to waiting for the sync_file on the cpu.
+  void WaitNativeFence(int fence) const;
+  // mburakov: Returns tiled or compressed modifiers of the fourcc that could be
+  // imported and bound to GL_TEXTURE_2D, in the order of preference of the
+  // driver. Linear is not included, as it's always supported. Returns nothing
+  // without EGL_EXT_image_dma_buf_import_modifiers.
+  std::vector<std::uint64_t> QueryModifiers(std::uint32_t fourcc) const;
 
  private:
+  EglContext(EGLenum platform, void* native_display, const char* extension,
+             EGLint major_version, EGLint minor_version);
+
   EGLDisplay display_;
+  bool owns_display_{true};
   EGLContext context_;
+  PFNEGLDUPNATIVEFENCEFDANDROIDPROC egl_dup_native_fence_fd_{};
+  PFNEGLQUERYDMABUFMODIFIERSEXTPROC egl_query_dma_buf_modifiers_{};
+};
+
+// mburakov: Measures gpu time of the commands issued between Begin and End.
+// Requires GL_EXT_disjoint_timer_query. Must be used with egl context current.
+class GlTimerQuery {
+ public:
+  GlTimerQuery();
+  ~GlTimerQuery();
+
+  GlTimerQuery(const GlTimerQuery&) = delete;
+  GlTimerQuery(GlTimerQuery&& other) = delete;
+  GlTimerQuery& operator=(const GlTimerQuery&) = delete;
+  GlTimerQuery& operator=(GlTimerQuery&& other) = delete;
+
+  static bool IsSupported();
+  void Begin() const;
+  void End() const;
+  // mburakov: Blocks until the result is available. Returns nothing if the
+  // measurement was disrupted, i.e. because of gpu frequency change.
+  std::optional<std::uint64_t> GetNanoseconds() const;
+
+ private:
+  PFNGLGENQUERIESEXTPROC gen_queries_{};
+  PFNGLDELETEQUERIESEXTPROC delete_queries_{};
+  PFNGLBEGINQUERYEXTPROC begin_query_{};
+  PFNGLENDQUERYEXTPROC end_query_{};
+  PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_object_{};
+  GLuint query_{};
 };
 
 std::string WrapEglError(const std::string& message,
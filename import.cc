@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "import.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gpu.h"
+#include "protocol.h"
+#include "socket.h"
+#include "utils.h"
+
+namespace {
+
+class ImportSource final : public FrameSource {
+ public:
+  ImportSource(const char* path, std::size_t width, std::size_t height,
+               const std::vector<std::uint64_t>& modifiers);
+
+  // FrameSource
+  const GbmBuffer* Acquire(
+      const GbmBuffer& buffer,
+      std::unique_ptr<std::nullptr_t, FdCloser>* fence) override;
+  void Release(const GbmBuffer* buffer, int fence) override;
+
+ private:
+  struct Imported {
+    std::uint64_t cookie;
+    GbmBuffer buffer;
+  };
+
+  std::string path_;
+  std::unique_ptr<const char, SocketUnlinker> unlinker_;
+  std::size_t width_;
+  std::size_t height_;
+  std::unique_ptr<std::nullptr_t, FdCloser> listener_;
+  std::unique_ptr<std::nullptr_t, FdCloser> connection_;
+  std::mutex mutex_;
+  std::deque<Imported> imported_;
+};
+
+ImportSource::ImportSource(const char* path, std::size_t width,
+                           std::size_t height,
+                           const std::vector<std::uint64_t>& modifiers)
+    : path_{path},
+      unlinker_{path_.c_str()},
+      width_{width},
+      height_{height},
+      listener_{ListenUnixSocket(path)},
+      connection_{AcceptUnixSocket(listener_.get())} {
+  ImportModifiers message{};
+  message.count = static_cast<std::uint32_t>(
+      std::min(modifiers.size(), kMaxModifiers));
+  std::copy_n(modifiers.begin(), message.count, message.modifiers);
+  SendMessage(connection_.get(), &message, sizeof(message), nullptr, 0);
+}
+
+const GbmBuffer* ImportSource::Acquire(
+    const GbmBuffer& buffer, std::unique_ptr<std::nullptr_t, FdCloser>* fence) {
+  ImportRequest request{};
+  std::unique_ptr<std::nullptr_t, FdCloser> fds[2];
+  std::size_t received{};
+  if (!ReceiveMessage(connection_.get(), &request, sizeof(request), fds, 2,
+                      &received)) {
+    return nullptr;
+  }
+  if (received != (request.has_fence ? 2 : 1))
+    throw std::runtime_error("Imported frame fds mismatch");
+  if (request.width != width_ || request.height != height_)
+    throw std::runtime_error("Imported frame dimensions mismatch");
+  if (request.fourcc != buffer.GetFourcc())
+    throw std::runtime_error("Imported frame format mismatch");
+  std::lock_guard<std::mutex> lock(mutex_);
+  imported_.push_back({request.cookie,
+                       GbmBuffer(fds[0].release(), width_, height_,
+                                 request.fourcc, request.stride,
+                                 request.offset, request.modifier)});
+  *fence = std::move(fds[1]);
+  return &imported_.back().buffer;
+}
+
+void ImportSource::Release(const GbmBuffer* buffer, int fence) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (imported_.empty() || &imported_.front().buffer != buffer)
+    throw std::logic_error("Imported frames are released out of order");
+  ImportRelease release{};
+  release.cookie = imported_.front().cookie;
+  release.has_fence = fence != -1;
+  imported_.pop_front();
+  lock.unlock();
+  SendMessage(connection_.get(), &release, sizeof(release), &fence,
+              release.has_fence ? 1 : 0);
+}
+
+}  // namespace
+
+std::unique_ptr<FrameSource> CreateImportSource(
+    const char* path, std::size_t width, std::size_t height,
+    const std::vector<std::uint64_t>& modifiers) {
+  return std::make_unique<ImportSource>(path, width, height, modifiers);
+}
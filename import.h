@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_IMPORT_H_
+#define FRAMESCONV_IMPORT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "pipeline.h"
+
+// mburakov: Listens on the provided unix socket path and waits for a single
+// producer to connect. Producer sends ImportRequest messages along with dma-buf
+// fds and optional fences, that are converted without copying, and gets
+// ImportRelease messages back, once corresponding dma-bufs could be reused.
+// Provided modifiers are advertised to producer right after it connects.
+std::unique_ptr<FrameSource> CreateImportSource(
+    const char* path, std::size_t width, std::size_t height,
+    const std::vector<std::uint64_t>& modifiers);
+
+#endif  // FRAMESCONV_IMPORT_H_
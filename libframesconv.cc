@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "libframesconv.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// mburakov: Makes provided context current for the lifetime of the object,
+// unless it is current already, and restores whatever was current before.
+class ScopedCurrent {
+ public:
+  explicit ScopedCurrent(const EglContext& context)
+      : context_{context},
+        previous_display_{eglGetCurrentDisplay()},
+        previous_draw_{eglGetCurrentSurface(EGL_DRAW)},
+        previous_read_{eglGetCurrentSurface(EGL_READ)},
+        previous_context_{eglGetCurrentContext()},
+        switched_{!context.IsCurrent()} {
+    if (switched_) context.MakeCurrent();
+  }
+
+  ~ScopedCurrent() {
+    if (!switched_) return;
+    if (previous_context_ == EGL_NO_CONTEXT) {
+      context_.ResetCurrent();
+      return;
+    }
+    eglMakeCurrent(previous_display_, previous_draw_, previous_read_,
+                   previous_context_);
+  }
+
+  ScopedCurrent(const ScopedCurrent&) = delete;
+  ScopedCurrent(ScopedCurrent&&) = delete;
+  ScopedCurrent& operator=(const ScopedCurrent&) = delete;
+  ScopedCurrent& operator=(ScopedCurrent&&) = delete;
+
+ private:
+  const EglContext& context_;
+  EGLDisplay previous_display_;
+  EGLSurface previous_draw_;
+  EGLSurface previous_read_;
+  EGLContext previous_context_;
+  bool switched_;
+};
+
+}  // namespace
+
+const GbmBuffer& Converter::Output::GetBuffer(std::size_t target) const {
+  return buffers_.at(target);
+}
+
+void Converter::Output::Recycler::operator()(
+    const Output* output) const noexcept {
+  output->busy_.store(false, std::memory_order_release);
+}
+
+Converter::Output::Output(const GbmDevice& device, EGLDisplay display,
+                          std::size_t width, std::size_t height,
+                          const FramesconvParams& params) {
+  buffers_.reserve(params.targets.size());
+  for (const auto& it : params.targets) {
+    const auto& descriptor =
+        GetLayoutDescriptor(GetScaledSize(width, it.scale),
+                            GetScaledSize(height, it.scale), it.layout,
+                            params.output);
+    buffers_.push_back(
+        device.CreateGbmBuffer(descriptor.width, descriptor.height));
+  }
+  for (const auto& it : buffers_) {
+    textures_.push_back(std::make_unique<GlTexture>(it, display));
+    textures_output_.push_back(textures_.back()->Get());
+  }
+}
+
+Converter::Converter(const char* render_node, std::size_t width,
+                     std::size_t height, std::uint32_t fourcc,
+                     const FramesconvParams& params, std::size_t pool_size)
+    : width_{width},
+      height_{height},
+      fourcc_{fourcc},
+      params_{params},
+      device_{render_node},
+      context_{device_, 3, 1} {
+  if (!pool_size) throw std::invalid_argument("Pool size must be positive");
+  ScopedCurrent current(context_);
+  // mburakov: Validates params and puts the program into the binary cache.
+  CreateFramesconvES31(params_);
+  for (std::size_t i = 0; i < pool_size; i++) {
+    pool_.emplace_back(
+        new Output(device_, context_.GetDisplay(), width, height, params_));
+  }
+}
+
+Converter::~Converter() {
+  // mburakov: Exiting threads lock their links before releasing their states,
+  // so links are detached without holding the lock of threads. Gl objects must
+  // be destroyed with a context current, and programs of threads must be
+  // destroyed with their own contexts current.
+  decltype(threads_) threads;
+  {
+    std::lock_guard<std::mutex> lock(threads_mutex_);
+    threads.swap(threads_);
+  }
+  for (auto& it : threads) {
+    {
+      std::lock_guard<std::mutex> lock(it.second.link->mutex);
+      it.second.link->converter = nullptr;
+    }
+    ScopedCurrent current(*it.second.context);
+    it.second.framesconv.reset();
+  }
+  ScopedCurrent current(context_);
+  pool_.clear();
+}
+
+Converter::OutputPtr Converter::Convert(
+    const GbmBuffer& source, int fence,
+    std::unique_ptr<std::nullptr_t, FdCloser>* completion) {
+  if (source.GetFourcc() != fourcc_)
+    throw std::invalid_argument("Source format mismatch");
+  OutputPtr result;
+  for (const auto& it : pool_) {
+    bool expected = false;
+    if (it->busy_.compare_exchange_strong(expected, true,
+                                          std::memory_order_acquire)) {
+      result.reset(it.get());
+      break;
+    }
+  }
+  if (!result) return result;
+
+  const auto& state = GetThreadState();
+  ScopedCurrent current(*state.context);
+  if (fence != -1) state.context->WaitNativeFence(fence);
+  GlTexture texture(source, state.context->GetDisplay());
+  state.framesconv->Convert(texture.Get(), width_, height_,
+                            result->textures_output_.data());
+  if (completion && state.context->HasNativeFence())
+    *completion = state.context->CreateNativeFence();
+  else
+    state.context->WaitFence(state.context->CreateFence());
+  return result;
+}
+
+const Converter::ThreadState& Converter::GetThreadState() {
+  // mburakov: Destroyed on thread exit, releasing states of the thread in all
+  // the converters that are still alive. Errors can't be reported from there,
+  // and the worst outcome of ignoring them is a leaked context.
+  struct ThreadLinks {
+    ~ThreadLinks() {
+      for (const auto& it : links) {
+        std::lock_guard<std::mutex> lock(it->mutex);
+        try {
+          if (it->converter) it->converter->ReleaseThreadState();
+        } catch (...) {
+        }
+      }
+    }
+    std::vector<std::shared_ptr<ThreadLink>> links;
+  };
+  static thread_local ThreadLinks thread_links;
+
+  {
+    std::lock_guard<std::mutex> lock(threads_mutex_);
+    auto it = threads_.find(std::this_thread::get_id());
+    if (it != threads_.end()) return it->second;
+  }
+
+  // mburakov: Only the calling thread creates its own state, so programs are
+  // compiled without holding the lock of threads.
+  ThreadState state;
+  state.context = std::make_unique<EglContext>(context_, 3, 1);
+  {
+    ScopedCurrent current(*state.context);
+    state.framesconv = CreateFramesconvES31(params_);
+  }
+  auto link = std::make_shared<ThreadLink>();
+  link->converter = this;
+  state.link = link;
+  const ThreadState* result;
+  {
+    std::lock_guard<std::mutex> lock(threads_mutex_);
+    result = &threads_.emplace(std::this_thread::get_id(), std::move(state))
+                  .first->second;
+  }
+
+  // mburakov: Links are only added once states are registered, so that every
+  // link of the thread is detached by the destructor of its converter. Links
+  // detached by converters destroyed before are dropped in passing.
+  auto& links = thread_links.links;
+  links.erase(std::remove_if(links.begin(), links.end(),
+                             [](const auto& it) {
+                               std::lock_guard<std::mutex> lock(it->mutex);
+                               return !it->converter;
+                             }),
+              links.end());
+  links.push_back(std::move(link));
+  return *result;
+}
+
+void Converter::ReleaseThreadState() {
+  std::unique_lock<std::mutex> lock(threads_mutex_);
+  auto it = threads_.find(std::this_thread::get_id());
+  if (it == threads_.end()) return;
+  ThreadState state = std::move(it->second);
+  threads_.erase(it);
+  lock.unlock();
+  ScopedCurrent current(*state.context);
+  state.framesconv.reset();
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_LIBFRAMESCONV_H_
+#define FRAMESCONV_LIBFRAMESCONV_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "framesconv.h"
+#include "gpu.h"
+#include "utils.h"
+
+// mburakov: Public api of libframesconv. Converter is the only class that is
+// safe to use from several threads at once, the rest of the classes it exposes
+// must not be shared between threads without external synchronization.
+
+// mburakov: Converts frames of fixed dimensions and fourcc on a single gpu
+// using OpenGL ES 3.1 path. Any amount of threads could convert at once. Every
+// calling thread gets its own egl context on the first call, sharing gl objects
+// with the others, so that threads do not serialize on a single context. The
+// context is current only during calls, and whatever was current before is
+// restored afterwards. Contexts of threads are released once threads exit.
+// Destination buffers are allocated upfront and taken from a lock-free pool.
+class Converter {
+ public:
+  // mburakov: Pooled destination buffers, one per target of params, returned
+  // to the pool once destroyed. Buffers must not be accessed after that.
+  class Output {
+   public:
+    const GbmBuffer& GetBuffer(std::size_t target) const;
+
+   private:
+    friend class Converter;
+    struct Recycler {
+      void operator()(const Output* output) const noexcept;
+    };
+
+    Output(const GbmDevice& device, EGLDisplay display, std::size_t width,
+           std::size_t height, const FramesconvParams& params);
+
+    std::vector<GbmBuffer> buffers_;
+    std::vector<std::unique_ptr<GlTexture>> textures_;
+    std::vector<GLuint> textures_output_;
+    mutable std::atomic<bool> busy_{};
+  };
+  using OutputPtr = std::unique_ptr<const Output, Output::Recycler>;
+
+  Converter(const char* render_node, std::size_t width, std::size_t height,
+            std::uint32_t fourcc, const FramesconvParams& params,
+            std::size_t pool_size);
+  ~Converter();
+
+  Converter(const Converter&) = delete;
+  Converter(Converter&&) = delete;
+  Converter& operator=(const Converter&) = delete;
+  Converter& operator=(Converter&&) = delete;
+
+  // mburakov: Source buffers must be created by the caller, either allocated
+  // on the device of the converter, or imported from dma-bufs.
+  const GbmDevice& GetDevice() const { return device_; }
+
+  // mburakov: Converts the source into a pooled output. If fence is not -1,
+  // gpu waits for it before reading the source. With native fences support,
+  // returns as soon as conversion is submitted, setting completion to a
+  // sync_file fd signaled once it is done, otherwise returns once conversion is
+  // done and leaves completion intact. The latter also happens if completion is
+  // nullptr. Source could be reused, and output could be returned to the pool
+  // once conversion is done. Returns nullptr if all the outputs of the pool are
+  // in use.
+  OutputPtr Convert(const GbmBuffer& source, int fence,
+                    std::unique_ptr<std::nullptr_t, FdCloser>* completion);
+
+ private:
+  // mburakov: Programs are not shared between threads, because uniforms are
+  // part of the program state. Programs of threads are loaded from the binary
+  // cache warmed up by the constructor, so that creating them is cheap.
+  // Every thread holds links to the converters it has state in, so that it
+  // could release its states on exit. Converters detach links on destruction.
+  struct ThreadLink {
+    std::mutex mutex;
+    Converter* converter;
+  };
+  struct ThreadState {
+    std::unique_ptr<EglContext> context;
+    std::unique_ptr<Framesconv> framesconv;
+    std::shared_ptr<ThreadLink> link;
+  };
+
+  const ThreadState& GetThreadState();
+  void ReleaseThreadState();
+
+  std::size_t width_;
+  std::size_t height_;
+  std::uint32_t fourcc_;
+  FramesconvParams params_;
+  GbmDevice device_;
+  EglContext context_;
+  std::vector<std::unique_ptr<Output>> pool_;
+  std::mutex threads_mutex_;
+  std::map<std::thread::id, ThreadState> threads_;
+};
+
+#endif  // FRAMESCONV_LIBFRAMESCONV_H_
@@ -15,139 +15,611 @@
  * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <EGL/egl.h>
-#include <GLES3/gl3.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <chrono>
 #include <cstddef>
+#include <cstdio>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
+#include "container.h"
+#include "daemon.h"
+#include "export.h"
+#include "fileio.h"
 #include "framesconv.h"
 #include "gpu.h"
+#include "import.h"
+#include "multidevice.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "tuning.h"
 #include "utils.h"
 
 namespace {
 
+enum class Implementation { kAuto, kES31, kES20, kCpu };
+
 struct Options {
   std::size_t width;
   std::size_t height;
   const char* input;
-  const char* output;
+  // mburakov: Output paths, one per target of params, in the same order.
+  std::vector<const char*> outputs;
   const char* render_node;
-  bool es20;
+  Implementation implementation;
+  // mburakov: Automatic selection of implementation only picks compute kernel
+  // if it was not provided explicitly.
+  bool kernel_provided;
+  std::uint32_t fourcc;
+  std::size_t frames;
+  std::size_t depth;
+  FramesconvParams params;
+  std::pair<std::size_t, std::size_t> workgroup;
+  bool tune;
+  const char* daemon;
+  // mburakov: Capacity of the staging buffers pool of the daemon, in bytes.
+  std::size_t pool_capacity;
+  bool stats;
+  std::size_t stats_interval;
+  // mburakov: Path to write per-frame luma statistics to.
+  const char* analysis;
+  // mburakov: Description of the mapped input, if any, see DescribeInput.
+  std::optional<MappedInput> mapped;
 };
 
+const char* PrefixedPath(const char* in, std::string_view prefix) {
+  if (!in || std::string_view(in).substr(0, prefix.size()) != prefix)
+    return nullptr;
+  return in + prefix.size();
+}
+
+const char* SocketPath(const char* in) { return PrefixedPath(in, "unix:"); }
+
+const char* MappedPath(const char* in) { return PrefixedPath(in, "mmap:"); }
+
 Options ParseCommandline(int argc, const char* const argv[]) {
   using namespace std::literals::string_view_literals;
-  static const auto& check_size = [](const char* in, int mask) {
+  static const auto& check_size = [](const char* in) {
     if (!in) throw std::invalid_argument("Missing argument");
     auto value = std::atoi(in);
     if (value <= 0) throw std::invalid_argument("Size must be positive");
-    if (value & mask) throw std::invalid_argument("Size must be aligned");
+    return static_cast<std::size_t>(value);
+  };
+  static const auto& check_count = [](const char* in) {
+    if (!in) throw std::invalid_argument("Missing argument");
+    auto value = std::atoi(in);
+    if (value < 0) throw std::invalid_argument("Count must be non-negative");
     return static_cast<std::size_t>(value);
   };
   static const auto& check_fname = [](const char* in) {
     return in == "-"sv ? nullptr : in;
   };
   static const auto& check_implementation = [](const char* in) {
-    if (in == "31"sv) return false;
-    if (in == "20"sv) return true;
+    if (!in) throw std::invalid_argument("Missing argument");
+    if (in == "auto"sv) return Implementation::kAuto;
+    if (in == "31"sv) return Implementation::kES31;
+    if (in == "20"sv) return Implementation::kES20;
+    if (in == "cpu"sv) return Implementation::kCpu;
     throw std::invalid_argument("Invalid implementation");
   };
+  static const auto& check_matrix = [](const char* in) {
+    if (!in) throw std::invalid_argument("Missing argument");
+    if (in == "601"sv) return ColorMatrix::kBT601;
+    if (in == "709"sv) return ColorMatrix::kBT709;
+    if (in == "2020"sv) return ColorMatrix::kBT2020;
+    throw std::invalid_argument("Invalid color matrix");
+  };
+  static const auto& check_layout = [](const char* in) {
+    if (!in) throw std::invalid_argument("Missing argument");
+    if (in == "nv12"sv) return OutputLayout::kNV12;
+    if (in == "i420"sv) return OutputLayout::kI420;
+    if (in == "nv16"sv) return OutputLayout::kNV16;
+    if (in == "nv24"sv) return OutputLayout::kNV24;
+    if (in == "yuyv"sv) return OutputLayout::kYUYV;
+    throw std::invalid_argument("Invalid output layout");
+  };
+  static const auto& check_scale = [](const char* in) {
+    if (!in) throw std::invalid_argument("Missing argument");
+    if (in == "1"sv) return std::size_t{1};
+    if (in == "2"sv) return std::size_t{2};
+    if (in == "4"sv) return std::size_t{4};
+    throw std::invalid_argument("Invalid scale");
+  };
+  static const auto& check_kernel = [](const char* in) {
+    if (!in) throw std::invalid_argument("Missing argument");
+    if (in == "direct"sv) return ComputeKernel::kDirect;
+    if (in == "shared"sv) return ComputeKernel::kShared;
+    throw std::invalid_argument("Invalid compute kernel");
+  };
+  static const auto& check_fourcc = [](const char* in) {
+    if (!in || std::strlen(in) != 4)
+      throw std::invalid_argument("Invalid fourcc");
+    std::uint32_t result = fourcc_code(in[0], in[1], in[2], in[3]);
+    GetBytesPerPixel(result);
+    return result;
+  };
+  static const auto& check_workgroup = [](const char* in) {
+    if (!in) throw std::invalid_argument("Missing argument");
+    int width{}, height{}, consumed{};
+    if (std::sscanf(in, "%dx%d%n", &width, &height, &consumed) != 2 ||
+        in[consumed] || width <= 0 || height <= 0) {
+      throw std::invalid_argument("Invalid workgroup size");
+    }
+    return std::make_pair(static_cast<std::size_t>(width),
+                          static_cast<std::size_t>(height));
+  };
   Options result{};
   result.render_node = "/dev/dri/renderD128";
+  result.fourcc = DRM_FORMAT_XBGR8888;
+  result.frames = 1;
+  result.depth = 3;
+  result.pool_capacity = std::size_t{256} << 20;
+  result.params.targets.clear();
+  // mburakov: Layout and scale apply to all the outputs following them.
+  OutputTarget target{};
+  bool target_pending = false;
   for (auto it = argv; it < argv + argc; it++) {
     if (*it == "-w"sv)
-      result.width = check_size(*++it, 0x7);
+      result.width = check_size(*++it);
     else if (*it == "-h"sv)
-      result.height = check_size(*++it, 0x3);
+      result.height = check_size(*++it);
     else if (*it == "-i"sv)
       result.input = check_fname(*++it);
-    else if (*it == "-o"sv)
-      result.output = check_fname(*++it);
-    else if (*it == "-r"sv)
+    else if (*it == "-o"sv) {
+      result.outputs.push_back(check_fname(*++it));
+      result.params.targets.push_back(target);
+      target_pending = false;
+    } else if (*it == "-y"sv) {
+      target.layout = check_layout(*++it);
+      target_pending = true;
+    } else if (*it == "-x"sv) {
+      target.scale = check_scale(*++it);
+      target_pending = true;
+    } else if (*it == "-r"sv)
       result.render_node = *++it;
     else if (*it == "-es"sv)
-      result.es20 = check_implementation(*++it);
+      result.implementation = check_implementation(*++it);
+    else if (*it == "-f"sv)
+      result.fourcc = check_fourcc(*++it);
+    else if (*it == "-n"sv)
+      result.frames = check_count(*++it);
+    else if (*it == "-d"sv)
+      result.depth = check_count(*++it);
+    else if (*it == "-m"sv)
+      result.params.matrix = check_matrix(*++it);
+    else if (*it == "-l"sv)
+      result.params.range = ColorRange::kLimited;
+    else if (*it == "-p010"sv)
+      result.params.output = OutputFormat::kP010;
+    else if (*it == "-dither"sv)
+      result.params.dither = true;
+    else if (*it == "-wg"sv)
+      result.workgroup = check_workgroup(*++it);
+    else if (*it == "-k"sv) {
+      result.params.kernel = check_kernel(*++it);
+      result.kernel_provided = true;
+    } else if (*it == "-tune"sv)
+      result.tune = true;
+    else if (*it == "-daemon"sv)
+      result.daemon = *++it;
+    else if (*it == "-pool"sv) {
+      const std::size_t megabytes = check_count(*++it);
+      if (megabytes > std::numeric_limits<std::size_t>::max() >> 20)
+        throw std::invalid_argument("Pool capacity is too large");
+      result.pool_capacity = megabytes << 20;
+    } else if (*it == "-s"sv) {
+      result.stats = true;
+      result.stats_interval = check_count(*++it);
+    } else if (*it == "-a"sv) {
+      result.analysis = *++it;
+      if (!result.analysis) throw std::invalid_argument("Missing argument");
+    }
+  }
+  if (!result.depth) throw std::invalid_argument("Depth must be positive");
+  if (result.outputs.empty()) {
+    result.outputs.push_back(nullptr);
+    result.params.targets.push_back(target);
+  } else if (target_pending) {
+    throw std::invalid_argument("Layout and scale must precede output");
   }
-  if (!result.width || !result.height) {
+  if (result.outputs.size() > kMaxOutputTargets)
+    throw std::invalid_argument("Too many outputs");
+  // mburakov: Dimensions of mapped inputs might come from their headers.
+  if (!result.daemon && !MappedPath(result.input) &&
+      (!result.width || !result.height)) {
     throw std::runtime_error(
         "Usage: framesconv [-i input] -w width -h height "
-        "[-o output] [-r render_node] [-es implementation]");
+        "[[-y layout] [-x scale] -o output]... [-r render_node] "
+        "[-es implementation] [-f fourcc] [-n frames] [-d depth] [-m matrix] "
+        "[-l] [-p010] [-dither] [-wg workgroup] [-k kernel] [-tune] "
+        "[-s interval] [-a analysis] [-daemon path] [-pool megabytes]");
   }
   return result;
 }
 
+bool HasSocket(const Options& options) {
+  if (options.daemon || SocketPath(options.input)) return true;
+  for (const char* it : options.outputs) {
+    if (SocketPath(it)) return true;
+  }
+  return false;
+}
+
+bool HasMapped(const Options& options) {
+  if (MappedPath(options.input)) return true;
+  for (const char* it : options.outputs) {
+    if (MappedPath(it)) return true;
+  }
+  return false;
+}
+
+// mburakov: Dimensions and fourcc of the container override provided ones.
+void DescribeInput(Options& options) {
+  const char* path = MappedPath(options.input);
+  if (!path) return;
+  options.mapped = DescribeMappedInput(path, options.width, options.height,
+                                       options.fourcc);
+  options.width = options.mapped->width;
+  options.height = options.mapped->height;
+  options.fourcc = options.mapped->fourcc;
+}
+
+// mburakov: Unix socket input imports dma-bufs of the producer directly,
+// mapped input is copied from its mapping, anything else is read from the file
+// descriptor. Producer is offered provided modifiers.
+std::unique_ptr<FrameSource> OpenSource(
+    const Options& options, std::unique_ptr<std::nullptr_t, FdCloser>& file,
+    const std::vector<std::uint64_t>& modifiers) {
+  if (const char* path = SocketPath(options.input)) {
+    return CreateImportSource(path, options.width, options.height,
+                              modifiers);
+  }
+  if (const char* path = MappedPath(options.input))
+    return CreateMappedSource(path, *options.mapped, options.depth);
+  if (!options.input) return CreateFileSource(STDIN_FILENO, options.depth);
+  file = OpenFile(options.input, O_RDONLY);
+  return CreateFileSource(file.get(), options.depth);
+}
+
+// mburakov: Returns a sink per target. Unix socket output exports dma-bufs to
+// the consumer directly, mapped output is copied into its mapping, anything
+// else is written to the file descriptor. Mapped output is preallocated for
+// the expected amount of frames, and gets a container header if the input had
+// one.
+std::vector<std::unique_ptr<FrameSink>> OpenSinks(
+    const Options& options, const FramesconvParams& params,
+    std::vector<std::unique_ptr<std::nullptr_t, FdCloser>>& files) {
+  std::size_t frames = options.frames;
+  if (options.mapped && (!frames || frames > options.mapped->frames))
+    frames = options.mapped->frames;
+  const bool container = options.mapped && options.mapped->container;
+  std::vector<std::unique_ptr<FrameSink>> result;
+  for (std::size_t i = 0; i < options.outputs.size(); i++) {
+    const char* output = options.outputs[i];
+    const auto& target = params.targets[i];
+    const std::size_t width = GetScaledSize(options.width, target.scale);
+    const std::size_t height = GetScaledSize(options.height, target.scale);
+    if (const char* path = SocketPath(output)) {
+      result.push_back(CreateExportSink(path, width, height, target.layout,
+                                        params.output));
+    } else if (const char* mapped = MappedPath(output)) {
+      result.push_back(CreateMappedSink(mapped, width, height, target.layout,
+                                        params.output, frames, container));
+    } else if (output) {
+      files.push_back(OpenFile(output, O_WRONLY | O_CREAT | O_TRUNC));
+      result.push_back(CreateFileSink(files.back().get(), width, height,
+                                      target.layout, params.output));
+    } else {
+      result.push_back(CreateFileSink(STDOUT_FILENO, width, height,
+                                      target.layout, params.output));
+    }
+  }
+  return result;
+}
+
+// mburakov: Writes statistics of a frame as a single line of JSON. Sad is null
+// if it's not valid.
+void WriteStatistics(std::ostream& stream, std::size_t frame,
+                     const FrameStatistics& statistics) {
+  char mean[32];
+  std::snprintf(mean, sizeof(mean), "%.3f", statistics.mean);
+  stream << "{\"frame\":" << frame << ",\"mean\":" << mean << ",\"sad\":";
+  if (statistics.has_sad)
+    stream << statistics.sad;
+  else
+    stream << "null";
+  stream << ",\"histogram\":[";
+  for (std::size_t i = 0; i < 256; i++)
+    stream << (i ? "," : "") << statistics.histogram[i];
+  stream << "]}\n";
+  if (!stream) throw std::runtime_error("Failed to write statistics");
+}
+
+// mburakov: Picks the fastest of the backends ranked for the gpu, that supports
+// provided options and parameters, and updates them accordingly. Support is
+// checked by creating the backend, which throws invalid_argument if it can't
+// handle parameters.
+void SelectBackend(const GbmDevice& device, const EglContext& context,
+                   Options& options, FramesconvParams& params) {
+  for (Backend it : RankBackends(device, context, options.width,
+                                 options.height, params,
+                                 !options.workgroup.first)) {
+    try {
+      switch (it) {
+        case Backend::kES31Direct:
+        case Backend::kES31Shared: {
+          FramesconvParams candidate_params = params;
+          candidate_params.kernel = it == Backend::kES31Shared
+                                        ? ComputeKernel::kShared
+                                        : ComputeKernel::kDirect;
+          if (options.kernel_provided &&
+              candidate_params.kernel != params.kernel) {
+            continue;
+          }
+          if (!options.workgroup.first) LoadWorkgroupSize(candidate_params);
+          CreateFramesconvES31(candidate_params);
+          options.implementation = Implementation::kES31;
+          params.kernel = candidate_params.kernel;
+          break;
+        }
+        case Backend::kES20:
+          CreateFramesconvES20(params);
+          options.implementation = Implementation::kES20;
+          break;
+        case Backend::kCpu:
+          // mburakov: Importing and exporting dma-bufs requires a gpu, and
+          // cpu implementation only supports streams anyway.
+          if (HasSocket(options) || HasMapped(options)) continue;
+          CreateFramesconvCpu(params, options.fourcc, 1);
+          options.implementation = Implementation::kCpu;
+          break;
+      }
+    } catch (const std::invalid_argument&) {
+      continue;
+    }
+    std::cerr << "Selected " << GetBackendName(it) << " backend" << std::endl;
+    return;
+  }
+  throw std::invalid_argument("No backend supports provided options");
+}
+
+void ReportDuration(std::size_t frames,
+                    std::chrono::steady_clock::duration duration) {
+  using namespace std::chrono;
+  auto millis = duration_cast<milliseconds>(duration);
+  std::cerr << "Colorspace conversion of " << frames << " frame(s) took "
+            << millis.count() << " milliseconds" << std::endl;
+}
+
+// mburakov: Cpu implementation converts frames one by one on the calling
+// thread, that is helped by the worker threads of the implementation itself.
+// Only streams are supported, because importing and exporting dma-bufs requires
+// a gpu in the first place.
+int RunCpu(const Options& options, const FramesconvParams& params,
+           Stats* stats) {
+  if (HasSocket(options)) {
+    throw std::invalid_argument(
+        "Cpu implementation does not support unix sockets");
+  }
+  if (HasMapped(options))
+    throw std::invalid_argument("Cpu implementation does not support mmap");
+  if (options.analysis)
+    throw std::invalid_argument("Frame statistics require -es 31");
+  std::ifstream input_file;
+  std::istream* input = &std::cin;
+  if (options.input) {
+    input_file.open(options.input);
+    input = &input_file;
+  }
+  if (options.outputs.size() != 1)
+    throw std::invalid_argument("Cpu implementation only supports one output");
+  std::ofstream output_file;
+  std::ostream* output = &std::cout;
+  if (options.outputs.front()) {
+    output_file.open(options.outputs.front());
+    output = &output_file;
+  }
+
+  const auto& framesconv = CreateFramesconvCpu(params, options.fourcc);
+  const std::size_t stride = options.width * GetBytesPerPixel(options.fourcc);
+  std::vector<char> rgbx(stride * options.height);
+  std::vector<char> nv12(GetPackedNv12Size(options.width, options.height));
+
+  using namespace std::chrono;
+  auto started = steady_clock::now();
+  std::size_t frames{};
+  for (; !options.frames || frames < options.frames; frames++) {
+    auto before = steady_clock::now();
+    input->read(rgbx.data(), static_cast<std::streamsize>(rgbx.size()));
+    // mburakov: Clean end of stream on a frame boundary is not an error.
+    if (!input->gcount() && input->eof()) {
+      if (options.frames) throw std::runtime_error("Unexpected end of source");
+      break;
+    }
+    if (!*input) throw std::runtime_error("Failed to read source");
+    auto read = steady_clock::now();
+    framesconv->Convert(rgbx.data(), stride, options.width, options.height,
+                        nv12.data());
+    auto converted = steady_clock::now();
+    output->write(nv12.data(), static_cast<std::streamsize>(nv12.size()));
+    output->flush();
+    if (!*output) throw std::runtime_error("Failed to write target");
+    if (stats) {
+      stats->Record(Stats::Stage::kUpload, read - before);
+      stats->Record(Stats::Stage::kSubmit, converted - read);
+      stats->Record(Stats::Stage::kDrain, steady_clock::now() - converted);
+      stats->FrameDone();
+    }
+  }
+  ReportDuration(frames, steady_clock::now() - started);
+  if (stats) stats->Report();
+  return EXIT_SUCCESS;
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) try {
   // mburakov: Parse commandline.
-  const auto& options = ParseCommandline(argc, argv);
-
-  // mburakov: Create gbm device and buffers.
-  GbmDevice device(options.render_node);
-  const auto& buffer_rgbx =
-      device.CreateGbmBuffer(options.width, options.height);
-  if (options.input) {
-    std::ifstream source(options.input);
-    buffer_rgbx.FillFrom(source);
-  } else {
-    buffer_rgbx.FillFrom(std::cin);
-  }
-  const auto& buffer_nv12 =
-      device.CreateGbmBuffer(options.width / 4, options.height * 3 / 2);
-
-  // mburakov: Createa and activate surfaceless egl context.
-  const auto& context_version =
-      options.es20 ? std::make_pair(2, 0) : std::make_pair(3, 1);
-  EglContext context(context_version.first, context_version.second);
-  context.MakeCurrent();
-  Defer deferred_reset_current([&context] { context.ResetCurrent(); });
-  EGLDisplay display = context.GetDisplay();
-
-  // mburakov: Create source image
-  EGLImage image_rgbx = buffer_rgbx.CreateEglImage(display);
-  Defer deferred_egl_destroy_image_rgbx(
-      [display, image_rgbx] { eglDestroyImage(display, image_rgbx); });
-  GLuint texture_rgbx = CreateGlTexture(GL_TEXTURE_2D, image_rgbx);
-  Defer deferred_gl_delete_textures_rgbx(
-      [texture_rgbx] { glDeleteTextures(1, &texture_rgbx); });
-
-  // mburakov: Create destination image.
-  EGLImage image_nv12 = buffer_nv12.CreateEglImage(display);
-  Defer deferred_egl_destroy_image_nv12(
-      [display, image_nv12] { eglDestroyImage(display, image_nv12); });
-  GLuint texture_nv12 = CreateGlTexture(GL_TEXTURE_2D, image_nv12);
-  Defer deferred_gl_delete_textures_nv12(
-      [texture_nv12] { glDeleteTextures(1, &texture_nv12); });
-
-  // mburakov: Select framesconv implementation
-  const auto& framesconv =
-      options.es20 ? CreateFramesconvES20() : CreateFramesconvES31();
+  auto options = ParseCommandline(argc, argv);
+  DescribeInput(options);
+  // mburakov: Only OpenGL ES 3.1 implementation supports these, so there's
+  // nothing to select from.
+  if (options.implementation == Implementation::kAuto &&
+      (options.tune || options.daemon || options.analysis ||
+       std::string_view(options.render_node) == "all")) {
+    options.implementation = Implementation::kES31;
+  }
+  FramesconvParams params = options.params;
+  if (options.workgroup.first) {
+    params.workgroup_width = options.workgroup.first;
+    params.workgroup_height = options.workgroup.second;
+  }
 
-  // mburakov: Do the colorspace conversion.
+  // mburakov: Stage latencies are reported to the standard error, because the
+  // standard output might be busy with frames.
   using namespace std::chrono;
-  auto before = steady_clock::now();
-  framesconv->Convert(texture_rgbx, options.width, options.height,
-                      texture_nv12);
-  context.Sync();
-  auto after = steady_clock::now();
-  auto millis = duration_cast<milliseconds>(after - before);
-  std::cerr << "Colorspace conversion took " << millis.count()
-            << " milliseconds" << std::endl;
-
-  // mburakov: Drain conversion result.
-  if (options.output) {
-    std::ofstream stream(options.output);
-    buffer_nv12.DrainTo(stream);
-  } else {
-    buffer_nv12.DrainTo(std::cout);
+  std::optional<Stats> stats;
+  if (options.stats) stats.emplace(std::cerr, seconds(options.stats_interval));
+
+  // mburakov: With all the render nodes every one of them gets its own gbm
+  // device, egl context and pipeline, see RunMultiDevice.
+  if (std::string_view(options.render_node) == "all") {
+    if (options.implementation != Implementation::kES31 || options.tune ||
+        options.daemon) {
+      throw std::invalid_argument(
+          "All render nodes only support -es 31 conversion");
+    }
+    // mburakov: Every gpu only sees a part of the frames, so there is no
+    // previous frame to compute sad against.
+    if (options.analysis) {
+      throw std::invalid_argument(
+          "Frame statistics require a single render node");
+    }
+    // mburakov: Frames are spread across gpus that might disagree on tiling,
+    // so producer is only offered linear.
+    std::unique_ptr<std::nullptr_t, FdCloser> input_file;
+    const auto& source = OpenSource(options, input_file, {});
+    std::vector<std::unique_ptr<std::nullptr_t, FdCloser>> output_files;
+    const auto& sinks = OpenSinks(options, params, output_files);
+    std::vector<FrameSink*> sinks_view;
+    for (const auto& it : sinks) sinks_view.push_back(it.get());
+    auto before = steady_clock::now();
+    std::size_t frames = RunMultiDevice(
+        EnumerateRenderNodes(), params, !options.workgroup.first,
+        options.width, options.height, options.fourcc, options.depth, *source,
+        sinks_view, options.frames, stats ? &*stats : nullptr);
+    ReportDuration(frames, steady_clock::now() - before);
+    if (stats) stats->Report();
+    return EXIT_SUCCESS;
+  }
+
+  // mburakov: Create gbm device, and create and activate surfaceless egl
+  // context. Automatic selection settles for OpenGL ES 2.0 context if that's
+  // the best the driver could do. If gpu is not usable, fall back to cpu
+  // implementation, unless dma-bufs or mappings are involved.
+  std::optional<GbmDevice> device;
+  std::optional<EglContext> context;
+  if (options.implementation != Implementation::kCpu) {
+    try {
+      device.emplace(options.render_node);
+      if (options.implementation == Implementation::kES20) {
+        context.emplace(2, 0);
+      } else {
+        try {
+          context.emplace(3, 1);
+        } catch (const std::exception& ex) {
+          if (options.implementation != Implementation::kAuto) throw;
+          std::cerr << ex.what() << ", trying OpenGL ES 2.0" << std::endl;
+          context.emplace(2, 0);
+        }
+      }
+      context->MakeCurrent();
+    } catch (const std::exception& ex) {
+      if (HasSocket(options) || HasMapped(options)) throw;
+      std::cerr << ex.what() << ", falling back to cpu implementation"
+                << std::endl;
+      context.reset();
+      device.reset();
+    }
+  }
+  if (!context) {
+    if (options.tune) throw std::invalid_argument("Tuning requires a gpu");
+    return RunCpu(options, params, stats ? &*stats : nullptr);
   }
+  Defer deferred_reset_current([&context] { context->ResetCurrent(); });
+  if (options.implementation == Implementation::kAuto) {
+    SelectBackend(*device, *context, options, params);
+    if (options.implementation == Implementation::kCpu)
+      return RunCpu(options, params, stats ? &*stats : nullptr);
+  }
+
+  // mburakov: Select compute workgroup size. Explicitly provided size takes
+  // precedence over the tuned one, that takes precedence over the default one.
+  const bool es20 = options.implementation == Implementation::kES20;
+  if (options.tune) {
+    if (es20) throw std::invalid_argument("Tuning requires -es 31");
+    TuneWorkgroupSize(*device, *context, options.width, options.height,
+                      params);
+    return EXIT_SUCCESS;
+  }
+  if (!options.workgroup.first && !es20) LoadWorkgroupSize(params);
+  if (options.daemon) {
+    if (es20) throw std::invalid_argument("Daemon requires -es 31");
+    RunDaemon(*device, *context, options.daemon, params,
+              options.pool_capacity);
+    return EXIT_SUCCESS;
+  }
+
+  // mburakov: Create ring of source and destination images.
+  Pipeline pipeline(*device, *context, options.width, options.height,
+                    options.fourcc, params.targets, params.output,
+                    options.depth);
+  std::unique_ptr<std::nullptr_t, FdCloser> input_file;
+  const auto& source = OpenSource(options, input_file,
+                                  context->QueryModifiers(options.fourcc));
+  std::vector<std::unique_ptr<std::nullptr_t, FdCloser>> output_files;
+  const auto& sinks = OpenSinks(options, params, output_files);
+  std::vector<FrameSink*> sinks_view;
+  for (const auto& it : sinks) sinks_view.push_back(it.get());
 
+  // mburakov: Select framesconv implementation. Frame statistics are gathered
+  // by the conversion itself.
+  std::ofstream analysis;
+  StatisticsCallback statistics;
+  if (options.analysis) {
+    if (es20) throw std::invalid_argument("Frame statistics require -es 31");
+    params.statistics = true;
+    analysis.open(options.analysis);
+    if (!analysis) throw std::runtime_error("Failed to open statistics");
+    statistics = [&analysis](std::size_t frame, const FrameStatistics& it) {
+      WriteStatistics(analysis, frame, it);
+    };
+  }
+  const auto& framesconv =
+      es20 ? CreateFramesconvES20(params) : CreateFramesconvES31(params);
+
+  // mburakov: Convert frames until the requested count is reached, or until
+  // the end of input if no count was requested. All the gpu state above is
+  // reused between frames.
+  auto before = steady_clock::now();
+  std::size_t frames =
+      pipeline.Run(*framesconv, *source, sinks_view, options.frames,
+                   stats ? &*stats : nullptr, statistics);
+  ReportDuration(frames, steady_clock::now() - before);
+  if (stats) stats->Report();
   return EXIT_SUCCESS;
 } catch (const std::exception& ex) {
   std::cerr << ex.what() << std::endl;
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "multidevice.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+
+#include "gpu.h"
+#include "tuning.h"
+#include "utils.h"
+
+namespace {
+
+// mburakov: Lets calls tagged with sequence numbers through one at a time, in
+// the order of sequence numbers, that must not have gaps.
+class Sequencer {
+ public:
+  // mburakov: Blocks until all the calls with lesser sequence numbers are done,
+  // and then makes the call. Throws if aborted.
+  template <class T>
+  void Invoke(std::uint64_t sequence, T&& call) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return aborted_ || next_ == sequence; });
+    if (aborted_) throw std::runtime_error("Conversion aborted");
+    lock.unlock();
+    Defer deferred_advance([this] {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        next_++;
+      }
+      cv_.notify_all();
+    });
+    call();
+  }
+
+  void Abort() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      aborted_ = true;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::uint64_t next_{};
+  bool aborted_{};
+};
+
+// mburakov: State shared by the devices. Frames are numbered in the order of
+// acquisition, and releases and writes of every sink are sequenced by these
+// numbers.
+struct Shared {
+  Shared(FrameSource& source, const std::vector<FrameSink*>& sinks,
+         std::size_t frames)
+      : source{source}, sinks{sinks}, frames{frames}, writes(sinks.size()) {}
+
+  void Abort() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ended = true;
+    }
+    releases.Abort();
+    for (auto& it : writes) it.Abort();
+  }
+
+  FrameSource& source;
+  const std::vector<FrameSink*>& sinks;
+  std::size_t frames;
+  std::mutex mutex;
+  std::uint64_t acquired{};
+  bool ended{};
+  Sequencer releases;
+  std::deque<Sequencer> writes;
+};
+
+// mburakov: Adapter of the shared source for the pipeline of a single device.
+// Every stage of the pipeline handles frames in the order of acquisition, so
+// sequence numbers of frames are remembered in a queue per stage.
+class DeviceSource final : public FrameSource {
+ public:
+  DeviceSource(Shared& shared, bool& acquired)
+      : shared_{shared}, acquired_{acquired}, writes_(shared.sinks.size()) {}
+
+  // FrameSource
+  const GbmBuffer* Acquire(
+      const GbmBuffer& buffer,
+      std::unique_ptr<std::nullptr_t, FdCloser>* fence) override;
+  void Release(const GbmBuffer* buffer, int fence) override;
+
+  // mburakov: Writes the next frame of this device to the shared sink.
+  void Write(std::size_t sink, const GbmBuffer& buffer, int fence,
+             std::function<void()> release);
+
+ private:
+  std::uint64_t Pop(std::deque<std::uint64_t>& sequences);
+
+  Shared& shared_;
+  bool& acquired_;
+  std::mutex mutex_;
+  std::deque<std::uint64_t> releases_;
+  std::vector<std::deque<std::uint64_t>> writes_;
+};
+
+const GbmBuffer* DeviceSource::Acquire(
+    const GbmBuffer& buffer, std::unique_ptr<std::nullptr_t, FdCloser>* fence) {
+  std::lock_guard<std::mutex> lock(shared_.mutex);
+  if (shared_.ended) return nullptr;
+  if (shared_.frames && shared_.acquired == shared_.frames) {
+    shared_.ended = true;
+    return nullptr;
+  }
+  const GbmBuffer* result = shared_.source.Acquire(buffer, fence);
+  if (!result) {
+    if (shared_.frames) throw std::runtime_error("Unexpected end of source");
+    shared_.ended = true;
+    return nullptr;
+  }
+  const std::uint64_t sequence = shared_.acquired++;
+  acquired_ = true;
+  std::lock_guard<std::mutex> device_lock(mutex_);
+  releases_.push_back(sequence);
+  for (auto& it : writes_) it.push_back(sequence);
+  return result;
+}
+
+void DeviceSource::Release(const GbmBuffer* buffer, int fence) {
+  shared_.releases.Invoke(Pop(releases_), [this, buffer, fence] {
+    shared_.source.Release(buffer, fence);
+  });
+}
+
+void DeviceSource::Write(std::size_t sink, const GbmBuffer& buffer, int fence,
+                         std::function<void()> release) {
+  shared_.writes[sink].Invoke(Pop(writes_[sink]), [&] {
+    shared_.sinks[sink]->Write(buffer, fence, std::move(release));
+  });
+}
+
+std::uint64_t DeviceSource::Pop(std::deque<std::uint64_t>& sequences) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (sequences.empty())
+    throw std::logic_error("Frame was not acquired by this device");
+  std::uint64_t result = sequences.front();
+  sequences.pop_front();
+  return result;
+}
+
+// mburakov: Adapter of a shared sink for the pipeline of a single device.
+class DeviceSink final : public FrameSink {
+ public:
+  DeviceSink(DeviceSource& source, std::size_t index, FrameSink& sink)
+      : source_{source}, index_{index}, sink_{sink} {}
+
+  // FrameSink
+  bool AcceptsFence() const override { return sink_.AcceptsFence(); }
+  void Write(const GbmBuffer& buffer, int fence,
+             std::function<void()> release) override {
+    source_.Write(index_, buffer, fence, std::move(release));
+  }
+  void Flush() override { sink_.Flush(); }
+
+ private:
+  DeviceSource& source_;
+  std::size_t index_;
+  FrameSink& sink_;
+};
+
+// mburakov: Sets acquired once the device acquires its first frame.
+std::size_t RunDevice(const std::string& render_node,
+                      FramesconvParams params, bool load_tuning,
+                      std::size_t width, std::size_t height,
+                      std::uint32_t fourcc, std::size_t depth, Shared& shared,
+                      Stats* stats, bool& acquired) {
+  GbmDevice device(render_node.c_str());
+  EglContext context(device, 3, 1);
+  context.MakeCurrent();
+  Defer deferred_reset_current([&context] { context.ResetCurrent(); });
+  if (load_tuning) LoadWorkgroupSize(params);
+
+  Pipeline pipeline(device, context, width, height, fourcc, params.targets,
+                    params.output, depth);
+  const auto& framesconv = CreateFramesconvES31(params);
+  DeviceSource source(shared, acquired);
+  std::vector<std::unique_ptr<FrameSink>> sinks;
+  std::vector<FrameSink*> sinks_view;
+  for (std::size_t i = 0; i < shared.sinks.size(); i++) {
+    sinks.push_back(
+        std::make_unique<DeviceSink>(source, i, *shared.sinks[i]));
+    sinks_view.push_back(sinks.back().get());
+  }
+  return pipeline.Run(*framesconv, source, sinks_view, 0, stats);
+}
+
+}  // namespace
+
+std::vector<std::string> EnumerateRenderNodes() {
+  using namespace std::literals::string_view_literals;
+  static constexpr auto kPrefix = "renderD"sv;
+  std::vector<std::string> result;
+  for (const auto& it : std::filesystem::directory_iterator("/dev/dri")) {
+    const std::string name = it.path().filename();
+    if (std::string_view(name).substr(0, kPrefix.size()) == kPrefix)
+      result.push_back(it.path().native());
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::size_t RunMultiDevice(const std::vector<std::string>& render_nodes,
+                           const FramesconvParams& params, bool load_tuning,
+                           std::size_t width, std::size_t height,
+                           std::uint32_t fourcc, std::size_t depth,
+                           FrameSource& source,
+                           const std::vector<FrameSink*>& sinks,
+                           std::size_t frames, Stats* stats) {
+  if (render_nodes.empty()) throw std::invalid_argument("No render nodes");
+  Shared shared(source, sinks, frames);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  std::exception_ptr skipped_error;
+  std::size_t skipped{};
+  std::vector<std::size_t> converted(render_nodes.size());
+  {
+    // mburakov: Failure of a device stops all the others once it acquired any
+    // frames, because these could not be written anymore. Devices failing
+    // before that, i.e. because they do not support OpenGL ES 3.1, lose
+    // nothing, so the others carry on without them.
+    std::vector<std::thread> threads;
+    Defer deferred_join([&threads] {
+      for (auto& it : threads) it.join();
+    });
+    for (std::size_t i = 0; i < render_nodes.size(); i++) {
+      threads.emplace_back([&, i] {
+        bool acquired = false;
+        try {
+          converted[i] =
+              RunDevice(render_nodes[i], params, load_tuning, width, height,
+                        fourcc, depth, shared, stats, acquired);
+        } catch (const std::exception& ex) {
+          std::unique_lock<std::mutex> lock(error_mutex);
+          if (!acquired) {
+            std::cerr << "Skipping " << render_nodes[i] << ": " << ex.what()
+                      << std::endl;
+            if (!skipped_error) skipped_error = std::current_exception();
+            skipped++;
+            return;
+          }
+          if (!error) error = std::current_exception();
+          lock.unlock();
+          shared.Abort();
+        } catch (...) {
+          {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = std::current_exception();
+          }
+          shared.Abort();
+        }
+      });
+    }
+  }
+  if (error) std::rethrow_exception(error);
+  if (skipped == render_nodes.size()) std::rethrow_exception(skipped_error);
+  std::size_t result{};
+  for (std::size_t it : converted) result += it;
+  return result;
+}
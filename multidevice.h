@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_MULTIDEVICE_H_
+#define FRAMESCONV_MULTIDEVICE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "framesconv.h"
+#include "pipeline.h"
+#include "stats.h"
+
+// mburakov: Returns paths of all the DRM render nodes of the system, sorted.
+std::vector<std::string> EnumerateRenderNodes();
+
+// mburakov: Runs OpenGL ES 3.1 pipeline of provided depth for every render node
+// on a separate thread with its own gbm device and egl context current, all of
+// them sharing the same source and sinks. Every device acquires the next frame
+// of the source as soon as it has a free slot, so that frames are spread across
+// devices according to their load, while source releases and sink writes are
+// put back in the order of acquisition. Persisted workgroup size is looked up
+// for every device separately if load_tuning is set. Devices failing before
+// they acquired any frames are skipped with a warning, while failure of a
+// device after that stops all the others. Returns amount of converted frames,
+// see Pipeline::Run.
+std::size_t RunMultiDevice(const std::vector<std::string>& render_nodes,
+                           const FramesconvParams& params, bool load_tuning,
+                           std::size_t width, std::size_t height,
+                           std::uint32_t fourcc, std::size_t depth,
+                           FrameSource& source,
+                           const std::vector<FrameSink*>& sinks,
+                           std::size_t frames, Stats* stats = nullptr);
+
+#endif  // FRAMESCONV_MULTIDEVICE_H_
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+
+#include "utils.h"
+
+struct Pipeline::Slot {
+  // mburakov: Destination buffer of a single layout along with its texture.
+  struct Output {
+    Output(const GbmDevice& device, EGLDisplay display,
+           const LayoutDescriptor& descriptor)
+        : buffer{device.CreateGbmBuffer(descriptor.width, descriptor.height)},
+          texture{buffer, display} {}
+
+    GbmBuffer buffer;
+    GlTexture texture;
+  };
+
+  Slot(const GbmDevice& device, EGLDisplay display, std::size_t width,
+       std::size_t height, std::uint32_t fourcc,
+       const std::vector<OutputTarget>& targets, OutputFormat output)
+      : display{display},
+        buffer_rgbx{device.CreateGbmBuffer(width, height, fourcc)},
+        texture_rgbx{buffer_rgbx, display} {
+    for (const auto& it : targets) {
+      outputs.emplace_back(std::make_unique<Output>(
+          device, display,
+          GetLayoutDescriptor(GetScaledSize(width, it.scale),
+                              GetScaledSize(height, it.scale), it.layout,
+                              output)));
+      textures_output.push_back(outputs.back()->texture.Get());
+    }
+  }
+
+  ~Slot() {
+    if (fence != EGL_NO_SYNC) eglDestroySync(display, fence);
+  }
+
+  Slot(const Slot&) = delete;
+  Slot(Slot&&) = delete;
+  Slot& operator=(const Slot&) = delete;
+  Slot& operator=(Slot&&) = delete;
+
+  // mburakov: Returns texture of the acquired source, importing it if it is
+  // external. Must be called with egl context current.
+  GLuint PrepareSource() {
+    texture_imported.reset();
+    if (source == &buffer_rgbx) return texture_rgbx.Get();
+    texture_imported.emplace(*source, display);
+    return texture_imported->Get();
+  }
+
+  // mburakov: Records gpu time of the previous conversion in this slot, if
+  // there is any. Must be called with egl context current.
+  void CollectTimer(Stats& stats) {
+    if (!std::exchange(timer_pending, false)) return;
+    if (auto nanos = timer->GetNanoseconds())
+      stats.Record(Stats::Stage::kGpu, *nanos / 1000);
+  }
+
+  // mburakov: Passes statistics of the previous conversion in this slot to the
+  // callback, if there is any. Must be called with egl context current.
+  void CollectStatistics(const StatisticsCallback& callback) {
+    if (!std::exchange(statistics_pending, false)) return;
+    callback(frame, statistics->Read());
+  }
+
+  EGLDisplay display;
+  GbmBuffer buffer_rgbx;
+  GlTexture texture_rgbx;
+  std::vector<std::unique_ptr<Output>> outputs;
+  std::vector<GLuint> textures_output;
+  std::atomic<std::size_t> pending_sinks{};
+  EGLSync fence{EGL_NO_SYNC};
+  std::unique_ptr<std::nullptr_t, FdCloser> fence_fd;
+  const GbmBuffer* source{};
+  std::unique_ptr<std::nullptr_t, FdCloser> source_fence;
+  std::optional<GlTexture> texture_imported;
+  std::optional<GlTimerQuery> timer;
+  bool timer_pending{};
+  std::optional<StatisticsBuffer> statistics;
+  bool statistics_pending{};
+  std::size_t frame{};
+};
+
+Pipeline::Pipeline(const GbmDevice& device, const EglContext& context,
+                   std::size_t width, std::size_t height, std::uint32_t fourcc,
+                   const std::vector<OutputTarget>& targets,
+                   OutputFormat output, std::size_t depth)
+    : context_{context}, width_{width}, height_{height} {
+  if (!depth) throw std::invalid_argument("Pipeline depth must be positive");
+  if (targets.empty())
+    throw std::invalid_argument("Pipeline requires at least one target");
+  slots_.reserve(depth);
+  for (std::size_t i = 0; i < depth; i++) {
+    slots_.emplace_back(std::make_unique<Slot>(
+        device, context.GetDisplay(), width, height, fourcc, targets, output));
+  }
+}
+
+Pipeline::~Pipeline() = default;
+
+std::size_t Pipeline::Run(const Framesconv& framesconv, FrameSource& source,
+                          const std::vector<FrameSink*>& sinks,
+                          std::size_t frames, Stats* stats,
+                          const StatisticsCallback& statistics) const {
+  using std::chrono::steady_clock;
+  if (sinks.size() != slots_.front()->outputs.size())
+    throw std::invalid_argument("Pipeline requires a sink per target");
+  // mburakov: Slots travel from free queue to filled queue, then to converted
+  // queue, and finally back to free queue. Closing the queues terminates the
+  // pipeline, either normally at the end of input, or abnormally on error.
+  BlockingQueue<Slot*> free_slots;
+  BlockingQueue<Slot*> filled_slots;
+  BlockingQueue<Slot*> converted_slots;
+  for (const auto& it : slots_) free_slots.Push(it.get());
+
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto abort = [&] {
+    {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = std::current_exception();
+    }
+    free_slots.Close();
+    filled_slots.Close();
+    converted_slots.Close();
+  };
+
+  std::size_t converted{};
+  std::thread filler([&] {
+    try {
+      Defer deferred_close([&filled_slots] { filled_slots.Close(); });
+      for (std::size_t i = 0; !frames || i < frames; i++) {
+        auto slot = free_slots.Pop();
+        if (!slot) return;
+        auto before = steady_clock::now();
+        (*slot)->source =
+            source.Acquire((*slot)->buffer_rgbx, &(*slot)->source_fence);
+        if (stats && (*slot)->source) {
+          stats->Record(Stats::Stage::kUpload,
+                        steady_clock::now() - before);
+        }
+        if (!(*slot)->source) {
+          if (frames) throw std::runtime_error("Unexpected end of source");
+          return;
+        }
+        filled_slots.Push(*slot);
+      }
+    } catch (...) {
+      abort();
+    }
+  });
+
+  std::thread drainer([&] {
+    try {
+      while (auto slot = converted_slots.Pop()) {
+        // mburakov: Without a fence fd the conversion must be complete before
+        // handing the buffer to the sink. Either way source is released right
+        // away, along with the fence fd if there is one.
+        Slot* it = *slot;
+        if (!it->fence_fd) {
+          auto before = steady_clock::now();
+          context_.WaitFence(std::exchange(it->fence, EGL_NO_SYNC));
+          if (stats) {
+            stats->Record(Stats::Stage::kFenceWait,
+                          steady_clock::now() - before);
+          }
+        }
+        source.Release(it->source, it->fence_fd.get());
+        auto before = steady_clock::now();
+        it->pending_sinks = sinks.size();
+        for (std::size_t i = 0; i < sinks.size(); i++) {
+          sinks[i]->Write(it->outputs[i]->buffer, it->fence_fd.get(),
+                          [&free_slots, &abort, it] {
+                            try {
+                              if (--it->pending_sinks) return;
+                              free_slots.Push(it);
+                            } catch (...) {
+                              abort();
+                            }
+                          });
+        }
+        it->fence_fd.reset();
+        if (stats) {
+          stats->Record(Stats::Stage::kDrain, steady_clock::now() - before);
+          stats->FrameDone();
+        }
+      }
+    } catch (...) {
+      abort();
+    }
+  });
+
+  // mburakov: Gpu time is only measured if the driver supports timer queries.
+  // Results are collected when the slot is reused, and after the last frame.
+  // mburakov: Fence fd is shared by all the sinks, so it's only used if every
+  // one of them accepts fences.
+  const bool use_fence_fd =
+      context_.HasNativeFence() &&
+      std::all_of(sinks.begin(), sinks.end(),
+                  [](const FrameSink* it) { return it->AcceptsFence(); });
+  const bool use_timer = stats && GlTimerQuery::IsSupported();
+  try {
+    Defer deferred_close([&converted_slots] { converted_slots.Close(); });
+    while (auto slot = filled_slots.Pop()) {
+      Slot* it = *slot;
+      if (use_timer) {
+        if (!it->timer) it->timer.emplace();
+        it->CollectTimer(*stats);
+      }
+      if (statistics) {
+        if (!it->statistics) it->statistics.emplace();
+        it->CollectStatistics(statistics);
+      }
+      auto before = steady_clock::now();
+      // mburakov: Gpu waits for the source itself, so that this thread is not
+      // blocked by the producer.
+      if (it->source_fence) {
+        context_.WaitNativeFence(it->source_fence.get());
+        it->source_fence.reset();
+      }
+      if (use_timer) it->timer->Begin();
+      if (statistics) {
+        framesconv.ConvertStatistics(it->PrepareSource(), width_, height_,
+                                     it->textures_output.data(),
+                                     it->statistics->Get());
+        it->statistics_pending = true;
+        it->frame = converted;
+      } else {
+        framesconv.Convert(it->PrepareSource(), width_, height_,
+                           it->textures_output.data());
+      }
+      if (use_timer) {
+        it->timer->End();
+        it->timer_pending = true;
+      }
+      if (use_fence_fd)
+        it->fence_fd = context_.CreateNativeFence();
+      else
+        it->fence = context_.CreateFence();
+      if (stats)
+        stats->Record(Stats::Stage::kSubmit, steady_clock::now() - before);
+      converted_slots.Push(it);
+      converted++;
+    }
+  } catch (...) {
+    abort();
+  }
+
+  filler.join();
+  drainer.join();
+  // mburakov: Release callbacks reference the state of this function.
+  try {
+    for (auto it : sinks) it->Flush();
+    if (use_timer && !error) {
+      for (const auto& it : slots_) it->CollectTimer(*stats);
+    }
+    if (statistics && !error) {
+      // mburakov: Statistics of the last frames are collected oldest first.
+      std::vector<Slot*> pending;
+      for (const auto& it : slots_) {
+        if (it->statistics_pending) pending.push_back(it.get());
+      }
+      std::sort(pending.begin(), pending.end(),
+                [](const Slot* a, const Slot* b) {
+                  return a->frame < b->frame;
+                });
+      for (auto it : pending) it->CollectStatistics(statistics);
+    }
+  } catch (...) {
+    abort();
+  }
+  if (error) std::rethrow_exception(error);
+  return converted;
+}
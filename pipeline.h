@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_PIPELINE_H_
+#define FRAMESCONV_PIPELINE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "framesconv.h"
+#include "gpu.h"
+#include "stats.h"
+#include "utils.h"
+
+struct FrameSource {
+  // mburakov: Called on the filling thread. Either fills provided buffer and
+  // returns it, or returns externally provided buffer of the same dimensions
+  // instead. Returns nullptr at the end of input. If the returned buffer is not
+  // ready yet, fence is set to a sync_file fd signaled once it is, and gpu
+  // waits for it before reading the buffer.
+  virtual const GbmBuffer* Acquire(
+      const GbmBuffer& buffer,
+      std::unique_ptr<std::nullptr_t, FdCloser>* fence) = 0;
+  // mburakov: Called on the draining thread once gpu is done with the buffer,
+  // or, if fence is not -1, as soon as reading the buffer is submitted. In the
+  // latter case fence is a sync_file fd signaled once gpu is done, and it is
+  // only valid during the call.
+  virtual void Release(const GbmBuffer* buffer, int fence) = 0;
+  virtual ~FrameSource() = default;
+};
+
+struct FrameSink {
+  // mburakov: Sinks accepting fences get the buffer as soon as conversion is
+  // submitted, along with a sync_file fd signaled on conversion completion.
+  // Other sinks get the buffer once conversion is complete, and fence is -1.
+  virtual bool AcceptsFence() const = 0;
+  // mburakov: Called on the draining thread. Release must be called exactly
+  // once, possibly later and from another thread, when the sink no longer
+  // needs the buffer, but not after Flush returns.
+  virtual void Write(const GbmBuffer& buffer, int fence,
+                     std::function<void()> release) = 0;
+  // mburakov: Blocks until all the written buffers are released.
+  virtual void Flush() = 0;
+  virtual ~FrameSink() = default;
+};
+
+// mburakov: Receives statistics of every converted frame along with its index,
+// counting from zero. Called on the converting thread.
+using StatisticsCallback =
+    std::function<void(std::size_t frame, const FrameStatistics& statistics)>;
+
+// mburakov: Ring of source and destination buffers, that allows filling the
+// next frame, converting the current frame and draining the previous one at
+// the same time. Filling and draining are done on dedicated threads, while
+// conversion happens on the calling thread, which must have the egl context
+// current.
+class Pipeline {
+ public:
+  // mburakov: Source buffers are allocated with provided drm fourcc, and
+  // there is a destination buffer per provided target in every slot.
+  Pipeline(const GbmDevice& device, const EglContext& context,
+           std::size_t width, std::size_t height, std::uint32_t fourcc,
+           const std::vector<OutputTarget>& targets, OutputFormat output,
+           std::size_t depth);
+  ~Pipeline();
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline(Pipeline&&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+  Pipeline& operator=(Pipeline&&) = delete;
+
+  // mburakov: Converts requested amount of frames, or all the frames until the
+  // end of input if frames is zero. Returns amount of converted frames. There
+  // must be a sink per target, in the same order, and a slot is reused once
+  // all of them release their buffers. Stage latencies are recorded into stats
+  // if provided. Frame statistics are gathered and passed to the callback if
+  // provided, which requires statistics parameter of framesconv. Statistics of
+  // a frame are collected once its slot is reused, and after the last frame.
+  std::size_t Run(const Framesconv& framesconv, FrameSource& source,
+                  const std::vector<FrameSink*>& sinks, std::size_t frames,
+                  Stats* stats = nullptr,
+                  const StatisticsCallback& statistics = {}) const;
+
+ private:
+  struct Slot;
+
+  const EglContext& context_;
+  std::size_t width_;
+  std::size_t height_;
+  std::vector<std::unique_ptr<Slot>> slots_;
+};
+
+#endif  // FRAMESCONV_PIPELINE_H_
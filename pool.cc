@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pool.h"
+
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
+void BufferPool::Recycler::operator()(Entry* entry) const noexcept {
+  if (pool_)
+    pool_->Recycle(entry);
+  else
+    delete entry;
+}
+
+BufferPool::BufferPool(const GbmDevice& device, EGLDisplay display,
+                       std::size_t capacity)
+    : device_{device}, display_{display}, capacity_{capacity} {}
+
+BufferPool::~BufferPool() = default;
+
+BufferPool::Lease BufferPool::Acquire(std::size_t width, std::size_t height,
+                                      std::uint32_t fourcc,
+                                      std::uint64_t modifier) {
+  if (modifier != DRM_FORMAT_MOD_LINEAR)
+    throw std::invalid_argument("Only linear buffers could be pooled");
+  Key key{width, height, fourcc, modifier};
+  std::unique_ptr<Entry> entry;
+  if (auto it = index_.find(key); it != index_.end()) {
+    // mburakov: Equal keys are ordered by insertion, while the most recently
+    // released buffer is the last one inserted.
+    auto last = std::prev(index_.upper_bound(key));
+    entry = std::move(last->second->entry);
+    idle_.erase(last->second);
+    index_.erase(last);
+    size_ -= entry->buffer.GetSize();
+  } else {
+    entry = std::make_unique<Entry>(device_, display_, width, height, fourcc);
+  }
+  // mburakov: Entry is only accounted once it's registered, so that entries
+  // destroyed by throwing registration do not inflate the size.
+  leased_.emplace(entry.get(), key);
+  size_ += entry->buffer.GetSize();
+  Lease result{entry.release(), Recycler{this}};
+  Trim();
+  return result;
+}
+
+void BufferPool::Recycle(Entry* entry) noexcept {
+  auto leased = leased_.find(entry);
+  Key key = leased->second;
+  leased_.erase(leased);
+  try {
+    idle_.push_front({key, std::unique_ptr<Entry>(entry)});
+  } catch (...) {
+    size_ -= entry->buffer.GetSize();
+    delete entry;
+    return;
+  }
+  try {
+    index_.emplace(key, idle_.begin());
+  } catch (...) {
+    size_ -= entry->buffer.GetSize();
+    idle_.pop_front();
+    return;
+  }
+  Trim();
+}
+
+void BufferPool::Trim() noexcept {
+  while (size_ > capacity_ && !idle_.empty()) {
+    auto lru = std::prev(idle_.end());
+    auto range = index_.equal_range(lru->key);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second != lru) continue;
+      index_.erase(it);
+      break;
+    }
+    size_ -= lru->entry->buffer.GetSize();
+    idle_.erase(lru);
+  }
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_POOL_H_
+#define FRAMESCONV_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <tuple>
+
+#include "gpu.h"
+
+// mburakov: Recycles gbm buffers along with their egl images and textures,
+// keyed on dimensions, fourcc and modifier. Released buffers are kept around
+// until total size of the buffers owned by the pool exceeds the capacity, at
+// which point least recently released ones are destroyed. Buffers in use are
+// never destroyed, so the pool could temporarily exceed the capacity. Not
+// thread-safe, must be used and destroyed with egl context current, and must
+// outlive all the buffers acquired from it.
+class BufferPool {
+ public:
+  struct Entry {
+    Entry(const GbmDevice& device, EGLDisplay display, std::size_t width,
+          std::size_t height, std::uint32_t fourcc)
+        : buffer{device.CreateGbmBuffer(width, height, fourcc)},
+          texture{buffer, display} {}
+
+    GbmBuffer buffer;
+    GlTexture texture;
+  };
+
+  class Recycler {
+   public:
+    Recycler(BufferPool* pool = nullptr) : pool_{pool} {}
+    void operator()(Entry* entry) const noexcept;
+
+   private:
+    BufferPool* pool_;
+  };
+  using Lease = std::unique_ptr<Entry, Recycler>;
+
+  BufferPool(const GbmDevice& device, EGLDisplay display,
+             std::size_t capacity);
+  ~BufferPool();
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool(BufferPool&&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+  BufferPool& operator=(BufferPool&&) = delete;
+
+  // mburakov: Returns the most recently released buffer with matching key, or
+  // allocates a new one. Only linear buffers are supported.
+  Lease Acquire(std::size_t width, std::size_t height, std::uint32_t fourcc,
+                std::uint64_t modifier = DRM_FORMAT_MOD_LINEAR);
+  std::size_t GetSize() const { return size_; }
+
+ private:
+  using Key = std::tuple<std::size_t, std::size_t, std::uint32_t,
+                         std::uint64_t>;
+  struct Idle {
+    Key key;
+    std::unique_ptr<Entry> entry;
+  };
+
+  void Recycle(Entry* entry) noexcept;
+  void Trim() noexcept;
+
+  const GbmDevice& device_;
+  EGLDisplay display_;
+  std::size_t capacity_;
+  std::size_t size_{};
+  // mburakov: Most recently released buffers are in front of the list.
+  std::list<Idle> idle_;
+  std::multimap<Key, std::list<Idle>::iterator> index_;
+  std::map<const Entry*, Key> leased_;
+};
+
+#endif  // FRAMESCONV_POOL_H_
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_PROTOCOL_H_
+#define FRAMESCONV_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// mburakov: Messages have no implicit padding, so that their layout does not
+// depend on the abi, and no uninitialized bytes are sent over sockets. Senders
+// zero-initialize messages, reserved fields included.
+
+// mburakov: Arbitrary limit, enough for any driver out there.
+constexpr std::size_t kMaxModifiers = 64;
+
+// mburakov: Sent to producer once it connects. Lists tiled or compressed
+// modifiers of the source fourcc framesconv could import, in the order of
+// preference of the driver, so that producer could allocate its frames with
+// the most efficient of them. Linear frames are always supported.
+struct ImportModifiers {
+  std::uint32_t count;
+  std::uint32_t reserved;
+  std::uint64_t modifiers[kMaxModifiers];
+};
+static_assert(sizeof(ImportModifiers) == 8 + 8 * kMaxModifiers);
+
+// mburakov: Sent by producer for every source frame along with the dma-buf fd
+// of the frame, and, if has_fence is set, with a sync_file fd signaled once the
+// frame is ready. Gpu waits for the fence itself, so producer could send frames
+// as soon as rendering is submitted. Dimensions and drm fourcc must match the
+// ones framesconv was started with.
+struct ImportRequest {
+  std::uint64_t cookie;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t fourcc;
+  std::uint32_t stride;
+  std::uint32_t offset;
+  std::uint32_t has_fence;
+  std::uint64_t modifier;
+};
+static_assert(sizeof(ImportRequest) == 40);
+
+// mburakov: Sent back to producer once gpu is done reading the frame, or, if
+// has_fence is set, once reading is submitted, along with a sync_file fd
+// signaled when gpu is done. The dma-buf can be reused after that. Frames are
+// released in the order of submission.
+struct ImportRelease {
+  std::uint64_t cookie;
+  std::uint32_t has_fence;
+  std::uint32_t reserved;
+};
+static_assert(sizeof(ImportRelease) == 16);
+
+// mburakov: Sent to consumer for every converted frame along with the dma-buf
+// fd of the frame, and, if has_fence is set, with a sync_file fd signaled once
+// conversion is complete. Buffer ids are stable, so consumers could cache their
+// imports of dma-bufs, that are actually a small pool reused over and over.
+// All the planes share the dma-buf, offsets and pitches of planes the fourcc
+// does not have are zero.
+struct ExportFrame {
+  std::uint64_t cookie;
+  std::uint32_t buffer_id;
+  std::uint32_t has_fence;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t fourcc;
+  std::uint32_t planes;
+  std::uint32_t offsets[3];
+  std::uint32_t pitches[3];
+  std::uint64_t modifier;
+};
+static_assert(sizeof(ExportFrame) == 64);
+
+// mburakov: Sent back by consumer once it no longer needs the dma-buf. When a
+// fence was attached, consumer must not release the frame before it's signaled.
+struct ExportRelease {
+  std::uint64_t cookie;
+};
+static_assert(sizeof(ExportRelease) == 8);
+
+// mburakov: Flags of ConvertRequest, see below.
+constexpr std::uint32_t kConvertSourceMemory = 1;
+constexpr std::uint32_t kConvertDestinationMemory = 2;
+constexpr std::uint32_t kConvertDither = 4;
+
+// mburakov: Arbitrary limit, clients are expected to merge their damage.
+constexpr std::size_t kMaxDamageRects = 16;
+
+// mburakov: Area of the source frame in pixels.
+struct ConvertDamage {
+  std::uint32_t x;
+  std::uint32_t y;
+  std::uint32_t width;
+  std::uint32_t height;
+};
+static_assert(sizeof(ConvertDamage) == 16);
+
+// mburakov: Sent by clients of framesconv daemon for every conversion, along
+// with the source fd followed by the destination fd. Source is either a dma-buf
+// described by fourcc and source fields, or, with kConvertSourceMemory flag, a
+// memfd holding tightly packed frame. Destination is either an ABGR8888 dma-buf
+// sized according to the layout, described by destination fields, or, with
+// kConvertDestinationMemory flag, a memfd receiving tightly packed planes.
+// Matrix, range, output and layout hold values of corresponding enums of
+// framesconv.h, and scale is either 1, 2 or 4. With kConvertDither flag samples
+// are dithered, see FramesconvParams. Without damage rects the whole frame is
+// converted. Otherwise only the damaged areas, aligned outwards to the
+// conversion grid, are read from the source and written to the destination,
+// leaving the rest of the destination untouched.
+struct ConvertRequest {
+  std::uint64_t cookie;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t fourcc;
+  std::uint32_t matrix;
+  std::uint32_t range;
+  std::uint32_t output;
+  std::uint32_t layout;
+  std::uint32_t scale;
+  std::uint32_t flags;
+  std::uint32_t source_stride;
+  std::uint32_t source_offset;
+  std::uint32_t reserved0;
+  std::uint64_t source_modifier;
+  std::uint32_t destination_stride;
+  std::uint32_t destination_offset;
+  std::uint64_t destination_modifier;
+  std::uint32_t damage_count;
+  ConvertDamage damage[kMaxDamageRects];
+  std::uint32_t reserved1;
+};
+static_assert(sizeof(ConvertRequest) == 88 + 16 * kMaxDamageRects);
+
+// mburakov: Sent back to client once conversion is complete, or, if has_fence
+// is set, once it is submitted, along with a sync_file fd signaled on
+// completion. Requests of every client are replied in order. Clients sending
+// malformed requests are disconnected.
+struct ConvertReply {
+  std::uint64_t cookie;
+  std::uint32_t has_fence;
+  std::uint32_t reserved;
+};
+static_assert(sizeof(ConvertReply) == 16);
+
+#endif  // FRAMESCONV_PROTOCOL_H_
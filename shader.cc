@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shader.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// mburakov: Red and blue luma coefficients of supported matrices.
+std::pair<float, float> GetLumaCoefficients(ColorMatrix matrix) {
+  switch (matrix) {
+    case ColorMatrix::kBT601:
+      return {0.299f, 0.114f};
+    case ColorMatrix::kBT709:
+      return {0.2126f, 0.0722f};
+    case ColorMatrix::kBT2020:
+      return {0.2627f, 0.0593f};
+  }
+  throw std::invalid_argument("Invalid color matrix");
+}
+
+void AppendDefine(std::string& result, const char* name, float value) {
+  // mburakov: Always emit decimal point, because GLSL ES 1.00 does not convert
+  // integer literals to floats implicitly.
+  char buffer[64];
+  std::snprintf(buffer, sizeof(buffer), "#define %s %#.9g\n", name,
+                static_cast<double>(value));
+  result += buffer;
+}
+
+void AppendDefine(std::string& result, const char* name, std::size_t value) {
+  result += "#define ";
+  result += name;
+  result += ' ';
+  result += std::to_string(value);
+  result += '\n';
+}
+
+}  // namespace
+
+ColorCoefficients GetColorCoefficients(const FramesconvParams& params) {
+  const auto& luma_coefficients = GetLumaCoefficients(params.matrix);
+  const bool limited = params.range == ColorRange::kLimited;
+  // mburakov: Limited range of 10-bit samples is the 8-bit one shifted by two
+  // bits, i.e. luma spans 64 to 940.
+  const bool p010 = params.output == OutputFormat::kP010;
+  const float max = p010 ? 1023.f : 255.f;
+  const float shift = p010 ? 4.f : 1.f;
+  return {luma_coefficients.first,
+          luma_coefficients.second,
+          limited ? 219.f * shift / max : 1.f,
+          limited ? 16.f * shift / max : 0.f,
+          limited ? 224.f * shift / max : 1.f,
+          limited ? 128.f * shift / max : 0.5f};
+}
+
+std::string SpecializeShader(const char* source,
+                             const FramesconvParams& params) {
+  std::string defines;
+  const auto& coefficients = GetColorCoefficients(params);
+  AppendDefine(defines, "KR", coefficients.kr);
+  AppendDefine(defines, "KB", coefficients.kb);
+  AppendDefine(defines, "Y_SCALE", coefficients.y_scale);
+  AppendDefine(defines, "Y_OFFSET", coefficients.y_offset);
+  AppendDefine(defines, "UV_SCALE", coefficients.uv_scale);
+  AppendDefine(defines, "UV_OFFSET", coefficients.uv_offset);
+  AppendDefine(defines, "WORKGROUP_WIDTH", params.workgroup_width);
+  AppendDefine(defines, "WORKGROUP_HEIGHT", params.workgroup_height);
+  if (params.output == OutputFormat::kP010) defines += "#define OUTPUT_P010\n";
+  if (params.dither) defines += "#define DITHER\n";
+
+  std::string result(source);
+  std::size_t position = 0;
+  if (const char* version = std::strstr(source, "#version")) {
+    position = result.find('\n', static_cast<std::size_t>(version - source));
+    position = position == std::string::npos ? result.size() : position + 1;
+  }
+  result.insert(position, defines);
+  return result;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_SHADER_H_
+#define FRAMESCONV_SHADER_H_
+
+#include <cstdint>
+#include <string>
+
+#include "framesconv.h"
+
+// mburakov: Conversion constants of the selected matrix and range, that are
+// shared between shaders and the cpu implementation.
+struct ColorCoefficients {
+  float kr;
+  float kb;
+  float y_scale;
+  float y_offset;
+  float uv_scale;
+  float uv_offset;
+};
+
+ColorCoefficients GetColorCoefficients(const FramesconvParams& params);
+
+// mburakov: Layout of the storage buffer of frame statistics, that matches the
+// std430 block of OpenGL ES 3.1 shader. Sad is split into a pair of words,
+// because shaders have no 64-bit atomics.
+struct StatisticsLayout {
+  std::uint32_t histogram[256];
+  std::uint32_t sad_low;
+  std::uint32_t sad_high;
+  std::uint32_t has_sad;
+};
+
+// mburakov: Returns shader source with conversion parameters defined as
+// preprocessor constants right after the #version directive, if any.
+std::string SpecializeShader(const char* source,
+                             const FramesconvParams& params);
+
+#endif  // FRAMESCONV_SHADER_H_
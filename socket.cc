@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "socket.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+
+// mburakov: Arbitrary limit, enough for every message in the protocol.
+constexpr std::size_t kMaxFds = 4;
+
+sockaddr_un MakeAddress(const char* path) {
+  sockaddr_un result{};
+  result.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(result.sun_path))
+    throw std::invalid_argument("Socket path is too long");
+  std::strcpy(result.sun_path, path);
+  return result;
+}
+
+std::unique_ptr<std::nullptr_t, FdCloser> CreateSocket() {
+  std::unique_ptr<std::nullptr_t, FdCloser> result{
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)};
+  if (!result) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to create socket");
+  }
+  return result;
+}
+
+}  // namespace
+
+std::unique_ptr<std::nullptr_t, FdCloser> ListenUnixSocket(const char* path) {
+  auto result = CreateSocket();
+  const auto& address = MakeAddress(path);
+  unlink(path);
+  if (bind(result.get(), reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address))) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to bind socket");
+  }
+  if (listen(result.get(), SOMAXCONN)) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to listen socket");
+  }
+  return result;
+}
+
+void SocketUnlinker::operator()(const char* path) const noexcept {
+  unlink(path);
+}
+
+std::unique_ptr<std::nullptr_t, FdCloser> AcceptUnixSocket(int listener) {
+  std::unique_ptr<std::nullptr_t, FdCloser> result{
+      accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)};
+  if (!result) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to accept socket");
+  }
+  return result;
+}
+
+std::unique_ptr<std::nullptr_t, FdCloser> ConnectUnixSocket(const char* path) {
+  auto result = CreateSocket();
+  const auto& address = MakeAddress(path);
+  if (connect(result.get(), reinterpret_cast<const sockaddr*>(&address),
+              sizeof(address))) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to connect socket");
+  }
+  return result;
+}
+
+void SendMessage(int sock, const void* data, std::size_t size, const int* fds,
+                 std::size_t fds_count) {
+  if (fds_count > kMaxFds) throw std::invalid_argument("Too many fds");
+  iovec iov = {const_cast<void*>(data), size};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fds_count) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds_count);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_count);
+  }
+  for (;;) {
+    ssize_t result = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (result == static_cast<ssize_t>(size)) return;
+    if (result < 0 && errno == EINTR) continue;
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to send message");
+  }
+}
+
+bool ReceiveMessage(int sock, void* data, std::size_t size,
+                    std::unique_ptr<std::nullptr_t, FdCloser>* fds,
+                    std::size_t fds_count, std::size_t* fds_received) {
+  if (fds_count > kMaxFds) throw std::invalid_argument("Too many fds");
+  iovec iov = {data, size};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t result;
+  do {
+    result = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to receive message");
+  }
+  if (!result) return false;
+
+  // mburakov: Take ownership of all the received fds first, so that none of
+  // them leak if the message turns out to be malformed.
+  std::size_t received{};
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (std::size_t i = 0; i < count; i++, received++) {
+      int fd;
+      std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (received < fds_count)
+        fds[received].reset(fd);
+      else
+        close(fd);
+    }
+  }
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+    throw std::runtime_error("Received message was truncated");
+  if (static_cast<std::size_t>(result) != size || received > fds_count ||
+      (!fds_received && received != fds_count)) {
+    throw std::runtime_error("Received message is malformed");
+  }
+  if (fds_received) *fds_received = received;
+  return true;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_SOCKET_H_
+#define FRAMESCONV_SOCKET_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "utils.h"
+
+// mburakov: All the sockets are SOCK_SEQPACKET unix domain sockets, so every
+// message along with its file descriptors is delivered atomically.
+std::unique_ptr<std::nullptr_t, FdCloser> ListenUnixSocket(const char* path);
+std::unique_ptr<std::nullptr_t, FdCloser> AcceptUnixSocket(int listener);
+std::unique_ptr<std::nullptr_t, FdCloser> ConnectUnixSocket(const char* path);
+
+// mburakov: Unlinks listening socket path on destruction. Owners of listening
+// sockets hold it as a member preceding the socket, so that the path is removed
+// even if the owner fails to construct after binding.
+struct SocketUnlinker {
+  void operator()(const char* path) const noexcept;
+};
+
+void SendMessage(int sock, const void* data, std::size_t size,
+                 const int* fds = nullptr, std::size_t fds_count = 0);
+// mburakov: Returns false if peer closed the connection. Exactly fds_count fds
+// are expected, unless fds_received is provided, in which case any amount up to
+// fds_count is accepted and reported back.
+bool ReceiveMessage(int sock, void* data, std::size_t size,
+                    std::unique_ptr<std::nullptr_t, FdCloser>* fds = nullptr,
+                    std::size_t fds_count = 0,
+                    std::size_t* fds_received = nullptr);
+
+#endif  // FRAMESCONV_SOCKET_H_
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace {
+
+const char* const kStageNames[] = {"upload", "submit", "gpu", "fence_wait",
+                                   "drain"};
+
+std::size_t GetBitWidth(std::uint64_t value) {
+  std::size_t result{};
+  for (; value; value >>= 1) result++;
+  return result;
+}
+
+}  // namespace
+
+void Histogram::Record(std::uint64_t value) {
+  // mburakov: Values below kSubBuckets are stored exactly, every subsequent
+  // power of two range gets its own kSubBuckets linear buckets.
+  std::size_t index = static_cast<std::size_t>(value);
+  if (value >= kSubBuckets) {
+    std::size_t shift = GetBitWidth(value) - GetBitWidth(kSubBuckets);
+    index = kSubBuckets * (shift + 1) +
+            static_cast<std::size_t>((value >> shift) & (kSubBuckets - 1));
+  }
+  buckets_[std::min(index, kBuckets - 1)]++;
+  count_++;
+  sum_ += value;
+  max_ = std::max(max_, value);
+}
+
+std::uint64_t Histogram::GetPercentile(double percentile) const {
+  if (!count_) return 0;
+  auto rank = static_cast<std::uint64_t>(
+      std::ceil(percentile / 100. * static_cast<double>(count_)));
+  rank = std::max<std::uint64_t>(rank, 1);
+  std::uint64_t seen{};
+  for (std::size_t index = 0; index < kBuckets; index++) {
+    seen += buckets_[index];
+    if (seen < rank) continue;
+    // mburakov: Report the lower bound of the bucket, but never above max.
+    if (index < kSubBuckets) return std::min<std::uint64_t>(index, max_);
+    std::size_t shift = index / kSubBuckets - 1;
+    std::uint64_t value = (kSubBuckets | (index % kSubBuckets)) << shift;
+    return std::min(value, max_);
+  }
+  return max_;
+}
+
+Stats::Stats(std::ostream& stream,
+             std::chrono::steady_clock::duration interval)
+    : stream_{stream},
+      interval_{interval},
+      last_report_{std::chrono::steady_clock::now()} {}
+
+void Stats::Record(Stage stage, std::chrono::steady_clock::duration duration) {
+  using namespace std::chrono;
+  auto micros = duration_cast<microseconds>(duration).count();
+  Record(stage, static_cast<std::uint64_t>(std::max<decltype(micros)>(
+                    micros, 0)));
+}
+
+void Stats::Record(Stage stage, std::uint64_t micros) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  histograms_[static_cast<std::size_t>(stage)].Record(micros);
+}
+
+void Stats::FrameDone() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  frames_++;
+  if (interval_ == std::chrono::steady_clock::duration::zero() ||
+      std::chrono::steady_clock::now() - last_report_ < interval_) {
+    return;
+  }
+  lock.unlock();
+  Report();
+}
+
+void Stats::Report() {
+  std::string json;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    json = ToJson();
+    frames_ = 0;
+    histograms_ = {};
+    last_report_ = std::chrono::steady_clock::now();
+  }
+  stream_ << json << std::endl;
+}
+
+std::string Stats::ToJson() const {
+  std::string result = "{\"frames\":" + std::to_string(frames_);
+  for (std::size_t i = 0; i < kStages; i++) {
+    const auto& histogram = histograms_[i];
+    result += ",\"";
+    result += kStageNames[i];
+    result += "\":{\"count\":" + std::to_string(histogram.GetCount()) +
+              ",\"mean\":" + std::to_string(histogram.GetMean()) +
+              ",\"p50\":" + std::to_string(histogram.GetPercentile(50)) +
+              ",\"p99\":" + std::to_string(histogram.GetPercentile(99)) +
+              ",\"max\":" + std::to_string(histogram.GetMax()) + "}";
+  }
+  return result + "}";
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_STATS_H_
+#define FRAMESCONV_STATS_H_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+// mburakov: Log-linear histogram of microsecond samples with fixed memory
+// footprint. Every power of two range is split into 16 linear buckets, so the
+// reported percentiles are precise within roughly 6%.
+class Histogram {
+ public:
+  void Record(std::uint64_t value);
+  std::uint64_t GetCount() const { return count_; }
+  std::uint64_t GetMax() const { return max_; }
+  std::uint64_t GetMean() const { return count_ ? sum_ / count_ : 0; }
+  std::uint64_t GetPercentile(double percentile) const;
+
+ private:
+  static constexpr std::size_t kSubBuckets = 16;
+  static constexpr std::size_t kBuckets = kSubBuckets * 61;
+
+  std::array<std::uint64_t, kBuckets> buckets_{};
+  std::uint64_t count_{};
+  std::uint64_t sum_{};
+  std::uint64_t max_{};
+};
+
+// mburakov: Per-stage latencies of the conversion pipeline. Safe to use from
+// any thread.
+class Stats {
+ public:
+  enum class Stage { kUpload, kSubmit, kGpu, kFenceWait, kDrain };
+
+  // mburakov: Zero interval disables periodic reports.
+  Stats(std::ostream& stream, std::chrono::steady_clock::duration interval);
+
+  void Record(Stage stage, std::chrono::steady_clock::duration duration);
+  void Record(Stage stage, std::uint64_t micros);
+  // mburakov: Counts completed frame, and emits periodic report if it's due.
+  void FrameDone();
+  // mburakov: Emits report of all the samples since the previous report.
+  void Report();
+
+ private:
+  static constexpr std::size_t kStages = 5;
+
+  std::string ToJson() const;
+
+  std::ostream& stream_;
+  const std::chrono::steady_clock::duration interval_;
+  std::mutex mutex_;
+  std::chrono::steady_clock::time_point last_report_;
+  std::uint64_t frames_{};
+  std::array<Histogram, kStages> histograms_;
+};
+
+#endif  // FRAMESCONV_STATS_H_
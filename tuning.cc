@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tuning.h"
+
+#include <GLES3/gl31.h>
+#include <libdrm/drm_fourcc.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "utils.h"
+
+namespace {
+
+// mburakov: Arbitrary set of sizes, covering wavefronts of 32 and 64 lanes.
+const std::pair<std::size_t, std::size_t> kCandidates[] = {
+    {1, 1},  {2, 2},  {4, 2},  {4, 4},  {8, 2},  {8, 4},
+    {8, 8},  {16, 4}, {16, 8}, {32, 1}, {32, 2}, {64, 1}};
+
+constexpr int kWarmupIterations = 4;
+constexpr int kMeasureIterations = 32;
+
+constexpr Backend kBackends[] = {Backend::kES31Direct, Backend::kES31Shared,
+                                 Backend::kES20, Backend::kCpu};
+
+std::string GetCachePath(const std::string& prefix) {
+  const auto& cache_dir = GetCacheDir();
+  const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  const char* renderer =
+      reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+  if (cache_dir.empty() || !version || !renderer) return {};
+  char name[24];
+  std::snprintf(name, sizeof(name), "-%016" PRIx64,
+                Fnv1aString(version, Fnv1aString(renderer)));
+  return cache_dir + "/" + prefix + name;
+}
+
+// mburakov: Kernels are tuned separately, because they have different memory
+// access patterns.
+std::string GetTuningPath(ComputeKernel kernel) {
+  return GetCachePath(kernel == ComputeKernel::kShared ? "workgroup-shared"
+                                                       : "workgroup");
+}
+
+// mburakov: Compute shaders require OpenGL ES 3.1, but the context might be
+// created with a lower version if that's all the driver supports.
+bool HasComputeShaders() {
+  const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  int major{}, minor{};
+  if (!version || std::sscanf(version, "OpenGL ES %d.%d", &major, &minor) != 2)
+    return false;
+  if (major < 3 || (major == 3 && minor < 1)) return false;
+  GLint max_invocations{};
+  glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+  return max_invocations > 0;
+}
+
+// mburakov: Returns nothing if there's no usable persisted ranking.
+std::vector<Backend> LoadRanking(const std::string& path) {
+  std::vector<Backend> result;
+  std::ifstream stream(path);
+  for (std::string name; stream >> name;) {
+    auto it = std::find_if(
+        std::begin(kBackends), std::end(kBackends),
+        [&name](Backend backend) { return name == GetBackendName(backend); });
+    if (it == std::end(kBackends)) return {};
+    result.push_back(*it);
+  }
+  return result;
+}
+
+// mburakov: Returns average duration of a conversion.
+template <typename Convert>
+std::chrono::steady_clock::duration Measure(const Convert& convert) {
+  using std::chrono::steady_clock;
+  for (int i = 0; i < kWarmupIterations; i++) convert();
+  auto before = steady_clock::now();
+  for (int i = 0; i < kMeasureIterations; i++) convert();
+  return (steady_clock::now() - before) / kMeasureIterations;
+}
+
+}  // namespace
+
+bool LoadWorkgroupSize(FramesconvParams& params) {
+  const auto& path = GetTuningPath(params.kernel);
+  if (path.empty()) return false;
+  std::ifstream stream(path);
+  std::size_t workgroup_width{}, workgroup_height{};
+  if (!(stream >> workgroup_width >> workgroup_height) || !workgroup_width ||
+      !workgroup_height) {
+    return false;
+  }
+  params.workgroup_width = workgroup_width;
+  params.workgroup_height = workgroup_height;
+  return true;
+}
+
+void TuneWorkgroupSize(const GbmDevice& device, const EglContext& context,
+                       std::size_t width, std::size_t height,
+                       FramesconvParams& params) {
+  GLint max_invocations{};
+  glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+  const auto& buffer_rgbx = device.CreateGbmBuffer(width, height);
+  const auto& buffer_nv12 =
+      device.CreateGbmBuffer(GetNv12Width(width), GetNv12Height(height));
+  GlTexture texture_rgbx(buffer_rgbx, context.GetDisplay());
+  GlTexture texture_nv12(buffer_nv12, context.GetDisplay());
+  const GLuint textures_output[] = {texture_nv12.Get()};
+
+  using namespace std::chrono;
+  auto best_duration = steady_clock::duration::max();
+  FramesconvParams best_params{};
+  for (const auto& it : kCandidates) {
+    if (it.first * it.second > static_cast<std::size_t>(max_invocations))
+      continue;
+    // mburakov: Workgroup size is tuned for single NV12 target, which is the
+    // most common case, and which the buffers above are sized for.
+    FramesconvParams candidate_params = params;
+    candidate_params.output = OutputFormat::kNV12;
+    candidate_params.targets = {OutputTarget{}};
+    candidate_params.workgroup_width = it.first;
+    candidate_params.workgroup_height = it.second;
+    // mburakov: Shared kernel rejects workgroups that do not fit into shared
+    // memory, these are not applicable either.
+    std::unique_ptr<Framesconv> framesconv;
+    try {
+      framesconv = CreateFramesconvES31(candidate_params);
+    } catch (const std::invalid_argument&) {
+      continue;
+    }
+    for (int i = 0; i < kWarmupIterations; i++) {
+      framesconv->Convert(texture_rgbx.Get(), width, height, textures_output);
+    }
+    context.Sync();
+
+    auto before = steady_clock::now();
+    for (int i = 0; i < kMeasureIterations; i++) {
+      framesconv->Convert(texture_rgbx.Get(), width, height, textures_output);
+    }
+    context.Sync();
+    auto duration = (steady_clock::now() - before) / kMeasureIterations;
+    std::cerr << "Workgroup size " << it.first << "x" << it.second << " took "
+              << duration_cast<microseconds>(duration).count()
+              << " microseconds" << std::endl;
+    if (duration < best_duration) {
+      best_duration = duration;
+      best_params = candidate_params;
+    }
+  }
+  if (best_duration == steady_clock::duration::max())
+    throw std::runtime_error("No applicable workgroup size candidates");
+
+  params.workgroup_width = best_params.workgroup_width;
+  params.workgroup_height = best_params.workgroup_height;
+  std::cerr << "Selected workgroup size " << params.workgroup_width << "x"
+            << params.workgroup_height << std::endl;
+  const auto& path = GetTuningPath(params.kernel);
+  if (path.empty()) return;
+  std::ofstream stream(path);
+  stream << params.workgroup_width << ' ' << params.workgroup_height
+         << std::endl;
+  if (!stream) throw std::runtime_error("Failed to persist tuning result");
+}
+
+const char* GetBackendName(Backend backend) {
+  switch (backend) {
+    case Backend::kES31Direct:
+      return "es31-direct";
+    case Backend::kES31Shared:
+      return "es31-shared";
+    case Backend::kES20:
+      return "es20";
+    case Backend::kCpu:
+      return "cpu";
+  }
+  throw std::invalid_argument("Invalid backend");
+}
+
+std::vector<Backend> RankBackends(const GbmDevice& device,
+                                  const EglContext& context,
+                                  std::size_t width, std::size_t height,
+                                  const FramesconvParams& params,
+                                  bool load_tuning) {
+  // mburakov: Ranking depends on dimensions, i.e. cpu might be the fastest for
+  // tiny frames, while being the slowest for large ones.
+  const auto& path = GetCachePath("backends-" + std::to_string(width) + "x" +
+                                  std::to_string(height));
+  if (!path.empty()) {
+    auto result = LoadRanking(path);
+    if (!result.empty()) return result;
+  }
+
+  // mburakov: Backends are measured end to end, reading the source from memory
+  // and writing the destination to memory, because only gpu backends pay for
+  // accessing uncached or write-combined mappings of gbm buffers. Cpu backend
+  // is measured with 4-bytes source, because it does not support other ones,
+  // and speed of those it supports is the same.
+  const auto& buffer_rgbx = device.CreateGbmBuffer(width, height);
+  const auto& buffer_nv12 =
+      device.CreateGbmBuffer(GetNv12Width(width), GetNv12Height(height));
+  GlTexture texture_rgbx(buffer_rgbx, context.GetDisplay());
+  GlTexture texture_nv12(buffer_nv12, context.GetDisplay());
+  const GLuint textures_output[] = {texture_nv12.Get()};
+  const auto& descriptor = GetLayoutDescriptor(
+      width, height, OutputLayout::kNV12, OutputFormat::kNV12);
+  std::istringstream input(std::string(width * height * 4, 0));
+  std::ostringstream output(std::string(GetPackedNv12Size(width, height), 0));
+  const auto& rewind = [&input, &output] {
+    input.clear();
+    input.seekg(0);
+    output.seekp(0);
+  };
+  const bool compute = HasComputeShaders();
+
+  using namespace std::chrono;
+  std::vector<std::pair<steady_clock::duration, Backend>> durations;
+  for (Backend it : kBackends) {
+    FramesconvParams candidate_params{};
+    candidate_params.matrix = params.matrix;
+    candidate_params.range = params.range;
+    candidate_params.workgroup_width = params.workgroup_width;
+    candidate_params.workgroup_height = params.workgroup_height;
+    steady_clock::duration duration{};
+    try {
+      if (it == Backend::kCpu) {
+        const auto& framesconv =
+            CreateFramesconvCpu(candidate_params, DRM_FORMAT_XBGR8888);
+        std::vector<char> rgbx(width * height * 4);
+        std::vector<char> nv12(GetPackedNv12Size(width, height));
+        duration = Measure([&] {
+          rewind();
+          input.read(rgbx.data(), static_cast<std::streamsize>(rgbx.size()));
+          framesconv->Convert(rgbx.data(), width * 4, width, height,
+                              nv12.data());
+          output.write(nv12.data(), static_cast<std::streamsize>(nv12.size()));
+        });
+      } else {
+        if (it != Backend::kES20 && !compute) continue;
+        std::unique_ptr<Framesconv> framesconv;
+        if (it == Backend::kES20) {
+          framesconv = CreateFramesconvES20(candidate_params);
+        } else {
+          candidate_params.kernel = it == Backend::kES31Shared
+                                        ? ComputeKernel::kShared
+                                        : ComputeKernel::kDirect;
+          if (load_tuning) LoadWorkgroupSize(candidate_params);
+          framesconv = CreateFramesconvES31(candidate_params);
+        }
+        duration = Measure([&] {
+          rewind();
+          buffer_rgbx.FillFrom(input);
+          framesconv->Convert(texture_rgbx.Get(), width, height,
+                              textures_output);
+          context.Sync();
+          for (std::size_t i = 0; i < descriptor.planes; i++) {
+            const auto& plane = descriptor.plane[i];
+            buffer_nv12.DrainTo(output, plane.row, plane.rows, plane.bytes);
+          }
+        });
+      }
+    } catch (const std::exception& ex) {
+      // mburakov: Drivers might advertise capabilities they fail to deliver,
+      // i.e. by failing to compile shaders. Such backends are not usable.
+      glGetError();
+      std::cerr << "Backend " << GetBackendName(it)
+                << " is not usable: " << ex.what() << std::endl;
+      continue;
+    }
+    std::cerr << "Backend " << GetBackendName(it) << " took "
+              << duration_cast<microseconds>(duration).count()
+              << " microseconds" << std::endl;
+    durations.emplace_back(duration, it);
+  }
+  std::stable_sort(
+      durations.begin(), durations.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  std::vector<Backend> result;
+  for (const auto& it : durations) result.push_back(it.second);
+  if (result.empty()) throw std::runtime_error("No usable backends");
+  if (path.empty()) return result;
+  std::ofstream stream(path);
+  for (Backend it : result) stream << GetBackendName(it) << ' ';
+  stream << std::endl;
+  if (!stream) throw std::runtime_error("Failed to persist backends ranking");
+  return result;
+}
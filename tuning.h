@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of framesconv.
+ *
+ * framesconv is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * framesconv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with framesconv.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCONV_TUNING_H_
+#define FRAMESCONV_TUNING_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "framesconv.h"
+#include "gpu.h"
+
+// mburakov: Workgroup size tuning for OpenGL ES 3.1 path. Tuning results are
+// persisted in the cache directory per gl renderer, gl version and compute
+// kernel of params. Both of the workgroup functions below must be called with
+// egl context current.
+
+// mburakov: Updates workgroup size of params with the persisted tuning result.
+// Returns false and leaves params intact if there's no persisted result.
+bool LoadWorkgroupSize(FramesconvParams& params);
+
+// mburakov: Benchmarks a set of candidate workgroup sizes converting frames of
+// provided dimensions, persists the fastest one and updates params accordingly.
+void TuneWorkgroupSize(const GbmDevice& device, const EglContext& context,
+                       std::size_t width, std::size_t height,
+                       FramesconvParams& params);
+
+// mburakov: Backends frames could be converted with, see Framesconv.
+enum class Backend { kES31Direct, kES31Shared, kES20, kCpu };
+
+const char* GetBackendName(Backend backend);
+
+// mburakov: Returns backends usable with the current egl context, fastest
+// first. Backends are probed for the capabilities they need, and benchmarked
+// converting frames of provided dimensions from memory into single NV12 target
+// in memory, using matrix and range of params, and persisted workgroup sizes if
+// load_tuning is set. Ranking is persisted in the cache directory per gl
+// renderer, gl version and dimensions, so that subsequent calls skip probing.
+// Must be called with egl context current.
+std::vector<Backend> RankBackends(const GbmDevice& device,
+                                  const EglContext& context,
+                                  std::size_t width, std::size_t height,
+                                  const FramesconvParams& params,
+                                  bool load_tuning);
+
+#endif  // FRAMESCONV_TUNING_H_
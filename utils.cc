@@ -17,6 +17,54 @@
 
 #include "utils.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
 void FdCloser::operator()(const pointer& ptr) const noexcept { close(ptr); }
+
+void Unmapper::operator()(void* data) const noexcept { munmap(data, size); }
+
+std::unique_ptr<std::nullptr_t, FdCloser> OpenFile(const char* path,
+                                                   int flags) {
+  std::unique_ptr<std::nullptr_t, FdCloser> result{
+      open(path, flags | O_CLOEXEC, 0644)};
+  if (!result) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to open " + std::string(path));
+  }
+  return result;
+}
+
+std::uint64_t Fnv1a(std::string_view data, std::uint64_t hash) {
+  for (char it : data) {
+    hash ^= static_cast<unsigned char>(it);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+std::uint64_t Fnv1aString(const char* data, std::uint64_t hash) {
+  return Fnv1a(std::string_view(data, std::strlen(data) + 1), hash);
+}
+
+std::string GetCacheDir() {
+  std::string result;
+  if (const char* xdg_cache_home = std::getenv("XDG_CACHE_HOME")) {
+    result = xdg_cache_home;
+  } else if (const char* home = std::getenv("HOME")) {
+    result = std::string(home) + "/.cache";
+  } else {
+    return {};
+  }
+  if (mkdir(result.c_str(), 0700) && errno != EEXIST) return {};
+  result += "/framesconv";
+  if (mkdir(result.c_str(), 0700) && errno != EEXIST) return {};
+  return result;
+}
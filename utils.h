@@ -18,6 +18,17 @@
 #ifndef FRAMESCONV_UTILS_H_
 #define FRAMESCONV_UTILS_H_
 
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
 struct FdCloser {
   class pointer {
    public:
@@ -33,6 +44,17 @@ struct FdCloser {
   void operator()(const pointer& ptr) const noexcept;
 };
 
+struct Unmapper {
+  std::size_t size;
+
+  void operator()(void* data) const noexcept;
+};
+
+// mburakov: Opens the file with O_CLOEXEC added to flags, creating it with 0644
+// mode if requested. Throws system_error mentioning the path on failure.
+std::unique_ptr<std::nullptr_t, FdCloser> OpenFile(const char* path,
+                                                   int flags);
+
 template <class T>
 class Defer {
  public:
@@ -46,4 +68,54 @@ class Defer {
 template <class T>
 Defer(T&&) -> Defer<T>;
 
+// mburakov: 64-bit FNV-1a, stable across runs and builds, unlike std::hash.
+constexpr std::uint64_t kFnv1aBasis = 0xcbf29ce484222325ull;
+std::uint64_t Fnv1a(std::string_view data, std::uint64_t hash = kFnv1aBasis);
+// mburakov: Hashes the terminating null too, so that chained hashes of strings
+// are unambiguous, i.e. "ab" followed by "c" does not collide with "a", "bc".
+std::uint64_t Fnv1aString(const char* data, std::uint64_t hash = kFnv1aBasis);
+
+// mburakov: Returns path to the framesconv directory inside the user cache
+// directory, creating it if needed. Returns empty string if there's no usable
+// cache directory, in which case caching should be silently skipped.
+std::string GetCacheDir();
+
+template <class T>
+class BlockingQueue {
+ public:
+  void Push(T value) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_) return;
+      queue_.push_back(std::move(value));
+    }
+    cv_.notify_one();
+  }
+
+  // mburakov: Blocks until a value is available. Returns nothing once the
+  // queue is closed and all the values pushed before closing were consumed.
+  std::optional<T> Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+    if (queue_.empty()) return std::nullopt;
+    T result = std::move(queue_.front());
+    queue_.pop_front();
+    return result;
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<T> queue_;
+  bool closed_{};
+};
+
 #endif  // FRAMESCONV_UTILS_H_